@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -43,17 +45,25 @@ static int config_add_layer(struct config *config, const char *s)
 	char buf[MAX_LAYER_NAME_LEN];
 	char *name;
 
+	if (strlen(s) >= sizeof buf) {
+		err("%s exceeds the maximum layer name length (%d)", s, MAX_LAYER_NAME_LEN - 1);
+		return -1;
+	}
+
 	strcpy(buf, s);
 	name = strtok(buf, ":");
 
 	if (name && layer_table_lookup(&config->layer_table, name) != -1)
 			return 1;
 
-	if (config->layer_table.nr >= MAX_LAYERS) {
-		err("max layers (%d) exceeded", MAX_LAYERS);
+	if (config->layer_table.nr == MAX_LAYERS) {
+		err("%s exceeds the maximum number of layers (%d)", name, MAX_LAYERS);
 		return -1;
 	}
 
+	if (layer_table_reserve(&config->layer_table, POOL_LAYERS, 1) < 0)
+		return -1;
+
 	ret = create_layer(&config->layer_table.layers[config->layer_table.nr],
 		s,
 		&config->layer_table);
@@ -61,14 +71,33 @@ static int config_add_layer(struct config *config, const char *s)
 	if (ret < 0)
 		return -1;
 
+	if (layer_table_add_keymap(&config->layer_table,
+				   &config->layer_table.layers[config->layer_table.nr]) < 0)
+		return -1;
+
+	if (layer_table_index_layer(&config->layer_table, config->layer_table.nr) < 0)
+		return -1;
+
+	if (config->layer_table.layers[config->layer_table.nr].type == LT_COMPOSITE)
+		config->composites[config->nr_composites++] = config->layer_table.nr;
+
 	config->layer_table.nr++;
 	return 0;
 }
 
+static const char *indicator_names[MAX_INDICATORS] = {
+	"numlock_indicator",
+	"capslock_indicator",
+	"scrolllock_indicator",
+	"compose_indicator",
+	"kana_indicator",
+};
+
 static void config_init(struct config *config)
 {
 	size_t i;
-	struct descriptor *km;
+	struct descriptor km[256] = {0};
+	struct layer_table *lt = &config->layer_table;
 
 	bzero(config, sizeof(*config));
 
@@ -80,7 +109,6 @@ static void config_init(struct config *config)
 	config_add_layer(config, "altgr:G");
 	config_add_layer(config, "alt:A");
 
-	km = config->layer_table.layers[0].keymap;
 	for (i = 0; i < 256; i++) {
 		km[i].op = OP_KEYCODE;
 		km[i].args[0].code = i;
@@ -101,12 +129,40 @@ static void config_init(struct config *config)
 		ent2->args[0].idx = idx;
 	}
 
-	config->layer_table.layers[0].flags = LF_ACTIVE;
+	for (i = 0; i < 256; i++) {
+		compile_descriptor(lt, &km[i]);
+		layer_table_bind(lt, &lt->layers[0], i, &km[i]);
+	}
 
 	/* In ms */
 	config->macro_timeout = 600;
 	config->macro_repeat_timeout = 50;
+	config->chord_timeout = 50;
+	config->leader_timeout = 1000;
+	config->lookahead_timeout = 200;
 
+	for (i = 0; i < MAX_INDICATORS; i++)
+		config->indicators[i] = -1;
+
+}
+
+/* Returns 0 if `key` names an LED indicator. */
+static int parse_indicator(struct config *config, const char *key, const char *val)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_INDICATORS; i++) {
+		if (!strcmp(key, indicator_names[i])) {
+			config->indicators[i] = layer_table_lookup(&config->layer_table, val);
+
+			if (config->indicators[i] == -1)
+				fprintf(stderr, "\tERROR: %s is not a valid layer.\n", val);
+
+			return 0;
+		}
+	}
+
+	return -1;
 }
 
 static void parse_globals(const char *path, struct config *config, struct ini_section *section)
@@ -125,9 +181,15 @@ static void parse_globals(const char *path, struct config *config, struct ini_se
 			config->macro_timeout = atoi(val);
 		else if (!strcmp(key, "macro_repeat_timeout"))
 			config->macro_repeat_timeout = atoi(val);
+		else if (!strcmp(key, "chord_timeout"))
+			config->chord_timeout = atoi(val);
+		else if (!strcmp(key, "leader_timeout"))
+			config->leader_timeout = atoi(val);
+		else if (!strcmp(key, "lookahead_timeout"))
+			config->lookahead_timeout = atoi(val);
 		else if (!strcmp(key, "layer_indicator"))
 			config->layer_indicator = atoi(val);
-		else
+		else if (parse_indicator(config, key, val) < 0)
 			fprintf(stderr, "\tERROR %s:%zd: %s is not a valid global option.\n",
 					path,
 					ent->lnum,
@@ -143,17 +205,25 @@ int config_parse(struct config *config, const char *path)
 
 	config_init(config);
 
-	if (!(ini = ini_parse_file(path, NULL)))
+	if (!(ini = ini_parse_file(path, NULL))) {
+		layer_table_free(&config->layer_table);
 		return -1;
+	}
 
 	/* First pass: create all layers based on section headers.  */
 	for (i = 0; i < ini->nr_sections; i++) {
 		section = &ini->sections[i];
 
 		if (!strcmp(section->name, "ids") ||
-		    !strcmp(section->name, "global"))
+		    !strcmp(section->name, "global") ||
+		    !strcmp(section->name, "leader"))
 			continue;
 
+		if (!strncmp(section->name, "leader:", 7)) {
+			fprintf(stderr, "ERROR %s:%zd: leader is a reserved section name\n",
+				path, section->lnum);
+			continue;
+		}
 
 		if (config_add_layer(config, section->name) < 0)
 			fprintf(stderr, "ERROR %s:%zd: %s\n", path, section->lnum, errstr);
@@ -165,7 +235,8 @@ int config_parse(struct config *config, const char *path)
 		char *name;
 		section = &ini->sections[i];
 
-		if (!strcmp(section->name, "ids"))
+		if (!strcmp(section->name, "ids") ||
+		    !strncmp(section->name, "leader:", 7))
 			continue;
 
 		if (!strcmp(section->name, "global")) {
@@ -175,6 +246,11 @@ int config_parse(struct config *config, const char *path)
 
 		name = strtok(section->name, ":");
 
+		/* The layer could not be created (and has already been diagnosed). */
+		if (name && strcmp(name, "leader") &&
+		    layer_table_lookup(&config->layer_table, name) == -1)
+			continue;
+
 		for (j = 0; j < section->nr_entries;j++) {
 			struct ini_entry *ent = &section->entries[j];
 
@@ -183,33 +259,743 @@ int config_parse(struct config *config, const char *path)
 		}
 	}
 
+	if (layer_table_pack(&config->layer_table) < 0) {
+		layer_table_free(&config->layer_table);
+		return -1;
+	}
+
 	return 0;
 }
 
-/* 
- * returns 1 in the case of a match and 2
- * in the case of an exact match.
+/*
+ * A compiled config image (<config>.bin) consists of the following header
+ * followed by the raw contents of the parsed struct config and the arena of
+ * its layer table. The arena contains only indices and is relocated to
+ * wherever it is loaded. Images are specific to the build which produced
+ * them and are ignored if the source config has since been modified.
  */
-static int config_check_match(const char *path, uint16_t vendor, uint16_t product)
+
+#define IMAGE_MAGIC	"KEYDIMG"
+#define IMAGE_VERSION	5
+
+struct image_header {
+	char magic[8];
+	char build[48]; /* The keyd version which produced the image. */
+	uint32_t version;
+	uint32_t size; /* sizeof(struct config) */
+
+	/* The state of the source config at compile time. */
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t src_size;
+};
+
+/* The arena is aligned within the image so that it can be used in place. */
+#define IMAGE_ARENA_OFFSET \
+	((sizeof(struct image_header) + sizeof(struct config) + 15) & ~(size_t)15)
+
+static void image_path(char *buf, size_t sz, const char *path)
 {
-	char line[32];
-	size_t line_sz = 0;
+	snprintf(buf, sz, "%s.bin", path);
+}
+
+static void image_header_init(struct image_header *hdr, const struct stat *st)
+{
+	memset(hdr, 0, sizeof *hdr);
+	memcpy(hdr->magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+	snprintf(hdr->build, sizeof hdr->build, "%s", VERSION);
+
+	hdr->version = IMAGE_VERSION;
+	hdr->size = sizeof(struct config);
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->src_size = st->st_size;
+}
+
+/*
+ * Sanity check the pool sizes (and indicators) of a loaded config against
+ * the size of the arena which follows it in the image, the engine trusts
+ * them.
+ */
+static int config_validate(const struct config *config, size_t arena_sz)
+{
+	size_t i;
+	const struct layer_table *lt = &config->layer_table;
+
+	for (i = 0; i < MAX_INDICATORS; i++)
+		if (config->indicators[i] < -1 || config->indicators[i] >= (int)lt->nr)
+			return 0;
+
+	if (config->nr_composites > MAX_LAYERS)
+		return 0;
+
+	for (i = 0; i < config->nr_composites; i++)
+		if (config->composites[i] >= lt->nr)
+			return 0;
+
+	/* Bound the counts first so computing the arena size can't overflow. */
+	return lt->nr <= MAX_LAYERS &&
+		lt->nr_keymaps <= MAX_KEYMAP_ENTRIES &&
+		lt->nr_layer_index <= MAX_LAYER_INDEX_SIZE &&
+		lt->nr_macros <= MAX_MACROS &&
+		lt->nr_macro_events <= arena_sz &&
+		lt->nr_bytecode <= MAX_BYTECODE_SIZE &&
+		lt->nr_timeouts <= MAX_TIMEOUTS &&
+		lt->nr_chords <= arena_sz &&
+		lt->nr_leader_nodes <= MAX_LEADER_NODES &&
+		lt->arena_sz == arena_sz &&
+		layer_table_arena_size(lt) == arena_sz;
+}
+
+#define INSN_START	0x1
+#define INSN_TARGET	0x2
+
+/*
+ * Check that the bytecode pool consists of complete instructions whose
+ * operands refer only to existing layers, macros and timeouts, and that
+ * every jump lands on an instruction. Programs are stored back to back, so
+ * a pool which ends with I_END can't be run off the end of. The start of
+ * each instruction is marked with INSN_START in `insn` (of size
+ * nr_bytecode).
+ */
+static int bytecode_valid(const struct layer_table *lt, uint8_t *insn)
+{
+	size_t pc = 0;
+	size_t last = 0;
+	const uint8_t *code = lt->bytecode;
+	size_t n = lt->nr_bytecode;
+
+	if (!n)
+		return 0;
+
+	while (pc < n) {
+		uint16_t idx;
+
+		insn[last = pc] |= INSN_START;
+
+		switch (code[pc++]) {
+		case I_END:
+		case I_LEADER:
+		case I_LOOKAHEAD:
+		case I_CLEAR_ONESHOT:
+		case I_RESET_LATCH:
+			break;
+		case I_JMP_RELEASED:
+		case I_JMP_TAP:
+			/* Jumps are forward, so targets are checked once all are known. */
+			if (pc >= n || pc + 1 + code[pc] >= n)
+				return 0;
+
+			insn[pc + 1 + code[pc]] |= INSN_TARGET;
+			pc++;
+			break;
+		case I_KEY_DOWN:
+		case I_KEY_UP:
+			pc++;
+			break;
+		case I_LAYER_ON:
+		case I_LAYER_OFF:
+		case I_LAYER_OFF_DISARM:
+		case I_ONESHOT_DOWN:
+		case I_ONESHOT_UP:
+		case I_TOGGLE:
+			if (pc >= n || code[pc++] >= lt->nr)
+				return 0;
+			break;
+		case I_MACRO:
+		case I_REPEAT:
+			if (pc + 2 > n)
+				return 0;
+
+			idx = code[pc] | code[pc+1] << 8;
+			pc += 2;
 
-	int fd = open(path, O_RDONLY);
+			if (idx >= lt->nr_macros)
+				return 0;
+			break;
+		case I_SWAP:
+			if (pc + 3 > n || code[pc] >= lt->nr)
+				return 0;
+
+			idx = code[pc+1] | code[pc+2] << 8;
+			pc += 3;
+
+			if (idx != 0xffff && idx >= lt->nr_macros)
+				return 0;
+			break;
+		case I_TIMEOUT:
+			if (pc + 2 > n)
+				return 0;
+
+			idx = code[pc] | code[pc+1] << 8;
+			pc += 2;
+
+			if (idx >= lt->nr_timeouts)
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	if (pc != n || code[last] != I_END)
+		return 0;
+
+	for (pc = 0; pc < n; pc++)
+		if (insn[pc] == INSN_TARGET)
+			return 0;
+
+	return 1;
+}
+
+static int descriptor_valid(const struct layer_table *lt, const uint8_t *insn, const struct descriptor *d)
+{
+	if (d->prog >= lt->nr_bytecode || !(insn[d->prog] & INSN_START))
+		return 0;
+
+	switch (d->op) {
+	case OP_UNDEFINED:
+	case OP_KEYCODE:
+	case OP_LEADER:
+		return 1;
+	case OP_ONESHOT:
+	case OP_LAYER:
+	case OP_TOGGLE:
+		return d->args[0].idx < lt->nr;
+	case OP_SWAP:
+	case OP_OVERLOAD:
+		return d->args[0].idx < lt->nr &&
+			(d->args[1].idx == 0xffff || d->args[1].idx < lt->nr_macros);
+	case OP_MACRO:
+		return d->args[0].idx < lt->nr_macros;
+	case OP_TIMEOUT:
+		return d->args[0].idx < lt->nr_timeouts;
+	}
+
+	return 0;
+}
+
+/*
+ * Check that every index and offset within the table lies within the pool
+ * to which it refers, the engine uses them unchecked.
+ */
+static int layers_valid(const struct layer_table *lt)
+{
+	size_t i, j;
+	int ret = 0;
+	uint8_t *insn;
+
+	/* Lookups require a power of 2 sized index with at least one free slot. */
+	if (lt->nr_layer_index & (lt->nr_layer_index - 1) ||
+	    lt->nr_layer_index < lt->nr * 2)
+		return 0;
+
+	for (i = 0; i < lt->nr_layer_index; i++)
+		if (lt->layer_index[i] > lt->nr)
+			return 0;
+
+	for (i = 0; i < lt->nr; i++) {
+		const struct layer *layer = &lt->layers[i];
+		size_t sz = layer->sparse ? keyset_count(&layer->keys) : 256;
+
+		if (layer->keymap + sz > lt->nr_keymaps ||
+		    !memchr(layer->name, 0, sizeof layer->name) ||
+		    layer->nr_layers > MAX_COMPOSITE_LAYERS)
+			return 0;
+
+		for (j = 0; j < layer->nr_layers; j++)
+			if (layer->layers[j] < 0 || (size_t)layer->layers[j] >= lt->nr)
+				return 0;
+	}
+
+	for (i = 0; i < lt->nr_macros; i++) {
+		const struct macro *m = &lt->macros[i];
+
+		if (m->start > lt->nr_macro_events || m->sz > lt->nr_macro_events - m->start)
+			return 0;
+	}
+
+	if (!(insn = calloc(lt->nr_bytecode ? lt->nr_bytecode : 1, 1)))
+		return 0;
+
+	if (!bytecode_valid(lt, insn))
+		goto out;
+
+	for (i = 0; i < lt->nr_keymaps; i++)
+		if (!descriptor_valid(lt, insn, &lt->keymaps[i]))
+			goto out;
+
+	for (i = 0; i < lt->nr_timeouts; i++)
+		if (!descriptor_valid(lt, insn, &lt->timeouts[i].d1) ||
+		    !descriptor_valid(lt, insn, &lt->timeouts[i].d2))
+			goto out;
+
+	for (i = 0; i < lt->nr_chords; i++)
+		if (lt->chords[i].layer < 0 || (size_t)lt->chords[i].layer >= lt->nr ||
+		    !descriptor_valid(lt, insn, &lt->chords[i].d))
+			goto out;
+
+	/* Links must point forward, otherwise the trie may contain cycles. */
+	for (i = 0; i < lt->nr_leader_nodes; i++) {
+		const struct leader_node *ln = &lt->leader_nodes[i];
+
+		if (ln->child >= lt->nr_leader_nodes || (ln->child && ln->child <= i) ||
+		    ln->next >= lt->nr_leader_nodes || (ln->next && ln->next <= i) ||
+		    !descriptor_valid(lt, insn, &ln->d))
+			goto out;
+	}
+
+	ret = 1;
+out:
+	free(insn);
+	return ret;
+}
+
+/*
+ * Parse the config at the given path and write the result to a compiled
+ * image alongside it.
+ */
+int config_compile(const char *path)
+{
+	int fd;
+	int ret = 0;
+	char dst[1024 + 8];
+	char tmp[1024 + 16];
+	struct stat st;
+	struct image_header hdr;
+	struct config *config;
+	struct layer_table *lt;
+	void *arena;
+
+	if (stat(path, &st) < 0) {
+		perror("stat");
+		return -1;
+	}
+
+	if (!(config = malloc(sizeof(struct config)))) {
+		err("out of memory");
+		return -1;
+	}
+
+	if (config_parse(config, path) < 0) {
+		free(config);
+		return -1;
+	}
+
+	image_header_init(&hdr, &st);
+	image_path(dst, sizeof dst, path);
+	snprintf(tmp, sizeof tmp, "%s.tmp", dst);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (fd < 0) {
 		perror("open");
-		return 0;
+		layer_table_free(&config->layer_table);
+		free(config);
+		return -1;
+	}
+
+	/* The pointers are meaningless once loaded, zero them so images are reproducible. */
+	lt = &config->layer_table;
+	arena = lt->arena;
+	lt->layers = NULL;
+	lt->layer_index = NULL;
+	lt->keymaps = NULL;
+	lt->timeouts = NULL;
+	lt->chords = NULL;
+	lt->leader_nodes = NULL;
+	lt->macros = NULL;
+	lt->macro_events = NULL;
+	lt->bytecode = NULL;
+	lt->arena = NULL;
+
+	if (write(fd, &hdr, sizeof hdr) != sizeof hdr ||
+	    write(fd, config, sizeof *config) != sizeof *config ||
+	    lseek(fd, IMAGE_ARENA_OFFSET, SEEK_SET) < 0 ||
+	    write(fd, arena, lt->arena_sz) != (ssize_t)lt->arena_sz) {
+		perror("write");
+		ret = -1;
+	}
+
+	close(fd);
+
+	lt->arena = arena;
+	layer_table_free(lt);
+	free(config);
+
+	/* Replace any existing image atomically. */
+	if (ret < 0 || rename(tmp, dst) < 0) {
+		unlink(tmp);
+		return -1;
 	}
 
+	return 0;
+}
+
+/*
+ * Populate config from the compiled image of the config at the given path.
+ * The image is mapped read-only and its arena used in place, so its pages
+ * are loaded on demand and shared with the page cache. Returns -1 if there
+ * is no valid image or it is stale.
+ */
+int config_load_image(struct config *config, const char *path)
+{
+	int fd;
+	void *p;
+	char img[1024 + 8];
+	struct stat st, img_st;
+	struct image_header hdr;
+	size_t sz;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	image_path(img, sizeof img, path);
+	if ((fd = open(img, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &img_st) < 0 || (size_t)img_st.st_size < IMAGE_ARENA_OFFSET) {
+		close(fd);
+		return -1;
+	}
+
+	sz = img_st.st_size;
+	p = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		return -1;
+
+	image_header_init(&hdr, &st);
+
+	if (memcmp(p, &hdr, sizeof hdr)) {
+		munmap(p, sz);
+		return -1;
+	}
+
+	memcpy(config, (const char *)p + sizeof hdr, sizeof *config);
+
+	if (!config_validate(config, sz - IMAGE_ARENA_OFFSET)) {
+		fprintf(stderr, "WARNING: %s is corrupt, ignoring\n", img);
+		munmap(p, sz);
+		return -1;
+	}
+
+	config->image = p;
+	config->image_sz = sz;
+	layer_table_relocate(&config->layer_table, (char *)p + IMAGE_ARENA_OFFSET);
+
+	if (!layers_valid(&config->layer_table)) {
+		fprintf(stderr, "WARNING: %s is corrupt, ignoring\n", img);
+		config_free(config);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Free the contents of a config populated by config_parse() or
+ * config_load_image(). The layer table of a loaded config lives entirely
+ * within the image.
+ */
+void config_free(struct config *config)
+{
+	if (config->image) {
+		munmap(config->image, config->image_sz);
+		config->image = NULL;
+	} else {
+		layer_table_free(&config->layer_table);
+	}
+}
+
+/*
+ * Parsed configs are shared between all keyboards which use them. Each
+ * instance is immutable and reference counted, and is cached by path (and
+ * the identity and modification time of the underlying file) until its last
+ * user releases it.
+ */
+static struct config **configs;
+static size_t nr_configs;
+static size_t max_configs;
+
+static void uncache(struct config *config)
+{
+	size_t i;
+
+	for (i = 0; i < nr_configs; i++) {
+		if (configs[i] == config) {
+			configs[i] = configs[--nr_configs];
+			return;
+		}
+	}
+}
+
+/*
+ * Obtain a reference to the parsed config at the given path, or NULL on
+ * failure. The result must be released with config_release().
+ */
+struct config *config_get(const char *path)
+{
+	size_t i;
+	struct stat st;
+	struct config *config;
+
+	if (stat(path, &st) < 0) {
+		perror("stat");
+		return NULL;
+	}
+
+	for (i = 0; i < nr_configs; i++) {
+		config = configs[i];
+
+		if (config->dev == st.st_dev &&
+		    config->ino == st.st_ino &&
+		    config->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    config->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+		    !strcmp(config->path, path)) {
+			config->refcount++;
+			return config;
+		}
+	}
+
+	if (!(config = malloc(sizeof(struct config)))) {
+		err("out of memory");
+		return NULL;
+	}
+
+	if (config_load_image(config, path) < 0 && config_parse(config, path) < 0) {
+		free(config);
+		return NULL;
+	}
+
+	dbg("%s: %zu bytes (%zu layers, %zu macros, %zu macro events, %zu bytes of bytecode)",
+	    path,
+	    sizeof(struct config) + config->layer_table.arena_sz,
+	    config->layer_table.nr,
+	    config->layer_table.nr_macros,
+	    config->layer_table.nr_macro_events,
+	    config->layer_table.nr_bytecode);
+
+	dbg("%s: %zu/%zu unique macros, %zu/%zu unique timeouts",
+	    path,
+	    config->layer_table.nr_macros,
+	    config->layer_table.nr_macro_defs,
+	    config->layer_table.nr_timeouts,
+	    config->layer_table.nr_timeout_defs);
+
+	config->refcount = 1;
+	config->dev = st.st_dev;
+	config->ino = st.st_ino;
+	config->mtime = st.st_mtim;
+	snprintf(config->path, sizeof config->path, "%s", path);
+
+	/* Failing to cache the config only forgoes sharing it. */
+	if (nr_configs == max_configs) {
+		size_t n = max_configs ? max_configs * 2 : 16;
+		struct config **p = realloc(configs, n * sizeof(struct config *));
+
+		if (p) {
+			configs = p;
+			max_configs = n;
+		}
+	}
+
+	if (nr_configs < max_configs)
+		configs[nr_configs++] = config;
+
+	return config;
+}
+
+void config_release(struct config *config)
+{
+	if (--config->refcount)
+		return;
+
+	uncache(config);
+	config_free(config);
+	free(config);
+}
+
+/*
+ * The config directory is watched with a single inotify instance, which
+ * both signals the daemon to reload configs and invalidates the device id
+ * index below.
+ */
+static struct {
+	char dir[PATH_MAX];
+	int fd;
+
+	/* Set when a drained event has yet to be reported by config_watch_read(). */
+	int changed;
+} watch = { .fd = -1 };
+
+/*
+ * An index of the [ids] sections of all configs within a directory, kept
+ * current by the config watch (if any). This allows devices to be matched
+ * against configs without rereading the directory (e.g when a dock exposes
+ * many devices at once).
+ */
+
+struct index_entry {
+	uint32_t id; /* <vendor>:<product> */
+
+	uint8_t used;
+	uint32_t file;
+
+	/* 2 for an exact match, 0 if the id excludes the device from a wildcard. */
+	uint8_t priority;
+};
+
+struct index_file {
+	char *path;
+
+	/* The last lookup which found an id excluding the device from this file. */
+	uint32_t excluded;
+};
+
+static struct {
+	char dir[PATH_MAX];
+
+	/* Only set if the index is kept current by the watch on dir. */
+	int valid;
+
+	struct index_file *files;
+	size_t nr_files;
+
+	/* Files which contain a wildcard, in directory order. */
+	uint32_t *wildcards;
+	size_t nr_wildcards;
+
+	size_t max_files;
+
+	/* Open addressed, the size is a power of 2 and kept at most half full. */
+	struct index_entry *entries;
+	size_t nr_entries;
+	size_t sz;
+
+	uint32_t lookup;
+} config_index;
+
+static size_t index_hash(uint32_t id)
+{
+	return (id * 2654435761u) & (config_index.sz - 1);
+}
+
+static struct index_entry *index_slot(uint32_t id, uint32_t file)
+{
+	size_t i;
+
+	for (i = index_hash(id); config_index.entries[i].used; i = (i + 1) & (config_index.sz - 1)) {
+		struct index_entry *ent = &config_index.entries[i];
+
+		if (ent->id == id && ent->file == file)
+			break;
+	}
+
+	return &config_index.entries[i];
+}
+
+/* Double the size of the hash table, reinserting existing entries. */
+static int index_grow()
+{
+	size_t i;
+	size_t sz = config_index.sz;
+	struct index_entry *entries = config_index.entries;
+
+	config_index.sz = sz ? sz * 2 : 256;
+	config_index.entries = calloc(config_index.sz, sizeof(struct index_entry));
+
+	if (!config_index.entries) {
+		config_index.entries = entries;
+		config_index.sz = sz;
+
+		err("out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < sz; i++)
+		if (entries[i].used)
+			*index_slot(entries[i].id, entries[i].file) = entries[i];
+
+	free(entries);
+
+	return 0;
+}
+
+static int index_add(uint32_t id, uint32_t file, uint8_t priority)
+{
+	struct index_entry *ent;
+
+	if (config_index.nr_entries >= config_index.sz / 2 && index_grow() < 0)
+		return -1;
+
+	ent = index_slot(id, file);
+
+	/* Only the first occurrence within a file counts. */
+	if (ent->used)
+		return 0;
+
+	ent->used = 1;
+	ent->id = id;
+	ent->file = file;
+	ent->priority = priority;
+
+	config_index.nr_entries++;
+
+	return 0;
+}
+
+/* Add the given file and the contents of its [ids] section to the index. */
+static int index_file(const char *path)
+{
+	char line[32];
+	size_t line_sz = 0;
+	uint32_t file = config_index.nr_files;
 	int seen_ids = 0;
 	int wildcard = 0;
+	int ret = 0;
+	int fd;
+
+	if (config_index.nr_files == config_index.max_files) {
+		size_t n = config_index.max_files ? config_index.max_files * 2 : 16;
+		struct index_file *files = realloc(config_index.files, n * sizeof(struct index_file));
+		uint32_t *wildcards;
+
+		if (files)
+			config_index.files = files;
+
+		wildcards = realloc(config_index.wildcards, n * sizeof(uint32_t));
+		if (wildcards)
+			config_index.wildcards = wildcards;
+
+		if (!files || !wildcards) {
+			err("out of memory");
+			return -1;
+		}
+
+		config_index.max_files = n;
+	}
+
+	if (!(config_index.files[file].path = strdup(path))) {
+		err("out of memory");
+		return -1;
+	}
+
+	config_index.files[file].excluded = 0;
+	config_index.nr_files++;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 0;
+	}
 
 	while (1) {
 		char buf[1024];
 		int i;
 		int n = read(fd, buf, sizeof buf);
 
-		if (!n)
+		if (n <= 0)
 			break;
 
 		for (i = 0; i < n; i++) {
@@ -234,18 +1020,15 @@ static int config_check_match(const char *path, uint16_t vendor, uint16_t produc
 						} else {
 							char *id = line;
 							uint16_t p, v;
-							int ret;
 
 							if (line[0] == '-')
 								id++;
 
-							if (line[0] != '#') {
-								ret = sscanf(id, "%hx:%hx", &v, &p);
-
-								if (ret == 2 && v == vendor && p == product) {
-									close(fd);
-									return wildcard ? 0 : 2;
-								}
+							/* Ids which follow a wildcard exclude the device. */
+							if (line[0] != '#' && sscanf(id, "%hx:%hx", &v, &p) == 2 &&
+							    index_add((uint32_t)v << 16 | p, file, wildcard ? 0 : 2) < 0) {
+								ret = -1;
+								goto end;
 							}
 						}
 					}
@@ -261,25 +1044,45 @@ static int config_check_match(const char *path, uint16_t vendor, uint16_t produc
 		}
 	}
 end:
-
 	close(fd);
-	return wildcard;
+
+	if (wildcard)
+		config_index.wildcards[config_index.nr_wildcards++] = file;
+
+	return ret;
 }
 
-/* 
- * scan a directory for the most appropriate match for a given vendor/product
- * pair and return the result. returns NULL if not match is found.
- */
-const char *config_find_path(const char *dir, uint16_t vendor, uint16_t product)
+static void index_clear()
+{
+	size_t i;
+
+	for (i = 0; i < config_index.nr_files; i++)
+		free(config_index.files[i].path);
+
+	if (config_index.entries)
+		memset(config_index.entries, 0, config_index.sz * sizeof(struct index_entry));
+
+	config_index.nr_entries = 0;
+	config_index.nr_files = 0;
+	config_index.nr_wildcards = 0;
+	config_index.valid = 0;
+}
+
+static int index_build(const char *dir)
 {
-	static char result[1024];
-	DIR *dh = opendir(dir);
+	DIR *dh;
 	struct dirent *ent;
-	int priority = 0;
 
+	index_clear();
+	snprintf(config_index.dir, sizeof config_index.dir, "%s", dir);
+
+	if (!config_index.entries && index_grow() < 0)
+		return -1;
+
+	dh = opendir(dir);
 	if (!dh) {
 		perror("opendir");
-		return NULL;
+		return -1;
 	}
 
 	while ((ent = readdir(dh))) {
@@ -290,15 +1093,162 @@ const char *config_find_path(const char *dir, uint16_t vendor, uint16_t product)
 			continue;
 
 		len = snprintf(path, sizeof path, "%s/%s", dir, ent->d_name);
-		if (len >= 5 && !strcmp(path+len-5, ".conf")) {
-			int ret = config_check_match(path, vendor, product);
-			if (ret && ret > priority) {
-				priority = ret;
-				strcpy(result, path);
-			}
+		if (len >= 5 && !strcmp(path+len-5, ".conf") && index_file(path) < 0) {
+			fprintf(stderr, "ERROR: failed to index %s: %s\n", path, errstr);
+			closedir(dh);
+			index_clear();
+			return -1;
 		}
 	}
 
 	closedir(dh);
-	return priority ? result : NULL;
+
+	/* Changes made during the scan are caught, since the watch predates it. */
+	config_index.valid = watch.fd != -1 && !strcmp(dir, watch.dir);
+
+	return 0;
+}
+
+/*
+ * Drain pending events from the config watch, invalidating the index if any
+ * of them concern a config (or may have been lost).
+ */
+static void watch_drain()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int n;
+
+	if (watch.fd == -1)
+		return;
+
+	while ((n = read(watch.fd, buf, sizeof buf)) > 0) {
+		char *ptr = buf;
+
+		while (ptr < buf + n) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+
+			if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+				/*
+				 * Events were lost or the directory is no
+				 * longer watched, so the index can't be
+				 * trusted (now or later).
+				 */
+				if (ev->mask & IN_IGNORED)
+					watch.dir[0] = 0;
+
+				watch.changed = 1;
+				config_index.valid = 0;
+			} else if (ev->len) {
+				size_t len = strlen(ev->name);
+
+				if (len >= 5 && !strcmp(ev->name+len-5, ".conf")) {
+					watch.changed = 1;
+					config_index.valid = 0;
+				}
+			}
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+/*
+ * Watch dir for modifications to configs. Returns an inotify descriptor
+ * suitable for polling, or -1 on failure. The same watch keeps the index
+ * used by config_find_path() current.
+ */
+int config_watch_create(const char *dir)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (fd < 0) {
+		perror("inotify");
+		return -1;
+	}
+
+	/* Only consider files once they have been completely written. */
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+		perror("inotify");
+		close(fd);
+		return -1;
+	}
+
+	if (watch.fd != -1)
+		close(watch.fd);
+
+	watch.fd = fd;
+	watch.changed = 0;
+	snprintf(watch.dir, sizeof watch.dir, "%s", dir);
+
+	config_index.valid = 0;
+
+	return fd;
+}
+
+/*
+ * Drain pending events from the descriptor returned by
+ * config_watch_create() and return 1 if any config has changed since the
+ * last call.
+ */
+int config_watch_read(int fd)
+{
+	int changed;
+
+	assert(fd == watch.fd);
+
+	watch_drain();
+
+	changed = watch.changed;
+	watch.changed = 0;
+
+	return changed;
+}
+
+/*
+ * Find the most appropriate config in dir for the given vendor/product pair
+ * (an exact match takes precedence over a wildcard, ties are broken by
+ * directory order). Returns NULL if no match is found.
+ */
+const char *config_find_path(const char *dir, uint16_t vendor, uint16_t product)
+{
+	size_t i;
+	long exact = -1;
+	uint32_t id = (uint32_t)vendor << 16 | product;
+
+	watch_drain();
+
+	if ((!config_index.valid || strcmp(dir, config_index.dir)) && index_build(dir) < 0)
+		return NULL;
+
+	/* Mark files as excluded by stamping them with the lookup. */
+	if (++config_index.lookup == 0) {
+		for (i = 0; i < config_index.nr_files; i++)
+			config_index.files[i].excluded = 0;
+
+		config_index.lookup = 1;
+	}
+
+	for (i = index_hash(id); config_index.entries[i].used; i = (i + 1) & (config_index.sz - 1)) {
+		const struct index_entry *ent = &config_index.entries[i];
+
+		if (ent->id != id)
+			continue;
+
+		if (!ent->priority)
+			config_index.files[ent->file].excluded = config_index.lookup;
+		else if (exact == -1 || ent->file < exact)
+			exact = ent->file;
+	}
+
+	if (exact != -1)
+		return config_index.files[exact].path;
+
+	for (i = 0; i < config_index.nr_wildcards; i++) {
+		struct index_file *file = &config_index.files[config_index.wildcards[i]];
+
+		if (file->excluded != config_index.lookup)
+			return file->path;
+	}
+
+	return NULL;
 }
@@ -9,17 +9,56 @@
 #define MAX_DEVICE_IDS 32
 #define MAX_CONFIG_NAME 256
 
+/* numlock, capslock, scrolllock, compose and kana (in evdev order). */
+#define MAX_INDICATORS 5
+
+#include <sys/types.h>
+#include <time.h>
+
 #include "layer.h"
 
 struct config {
 	struct layer_table layer_table;
 	long macro_timeout;
 	long macro_repeat_timeout;
+	long chord_timeout;
+	long leader_timeout;
+	long lookahead_timeout;
 
 	long layer_indicator;
+
+	/* The layer indicated by each LED, or -1. */
+	int indicators[MAX_INDICATORS];
+
+	/* The indices of composite layers, so lookups needn't scan every layer. */
+	uint8_t composites[MAX_LAYERS];
+	size_t nr_composites;
+
+	/*
+	 * The read-only mapping of the image from which the config was
+	 * loaded (if any), which holds the arena of the layer table.
+	 */
+	void *image;
+	size_t image_sz;
+
+	/* Bookkeeping for configs obtained with config_get(). */
+	int refcount;
+
+	char path[1024];
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
 };
 
 const char	*config_find_path(const char *dir, uint16_t vendor, uint16_t product);
+int		 config_watch_create(const char *dir);
+int		 config_watch_read(int fd);
 int		 config_parse(struct config *config, const char *path);
+int		 config_compile(const char *path);
+int		 config_load_image(struct config *config, const char *path);
+void		 config_free(struct config *config);
+
+struct config	*config_get(const char *path);
+void		 config_release(struct config *config);
 
 #endif
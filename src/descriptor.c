@@ -87,23 +87,19 @@ exit:
 
 static uint8_t parse_code(const char *s)
 {
-	size_t i;
-
-	for (i = 0; i < 256; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
+	uint8_t code;
 
-		if ((ent->name && !strcmp(ent->name, s)) || 
-		    (ent->alt_name && !strcmp(ent->alt_name, s)))
-			return i;
-	}
+	if (lookup_keycode(s, &code, NULL) < 0)
+		return 0;
 
-	return 0;
+	return code;
 }
 
 static int parse_sequence(const char *s, uint8_t *codep, uint8_t *modsp)
 {
 	const char *c = s;
-	size_t i;
+	uint8_t code;
+	int shifted;
 
 	if (!*s)
 		return -1;
@@ -135,37 +131,19 @@ static int parse_sequence(const char *s, uint8_t *codep, uint8_t *modsp)
 		c += 2;
 	}
 
-	for (i = 0; i < 256; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
-
-		if (ent->name) {
-			if (ent->shifted_name &&
-			    !strcmp(ent->shifted_name, c)) {
-
-				mods |= MOD_SHIFT;
-
-				if (modsp)
-					*modsp = mods;
-
-				if (codep)
-					*codep = i;
+	if (lookup_keycode(c, &code, &shifted) < 0)
+		return -1;
 
-				return 0;
-			} else if (!strcmp(ent->name, c) ||
-				   (ent->alt_name && !strcmp(ent->alt_name, c))) {
+	if (shifted)
+		mods |= MOD_SHIFT;
 
-				if (modsp)
-					*modsp = mods;
+	if (modsp)
+		*modsp = mods;
 
-				if (codep)
-					*codep = i;
+	if (codep)
+		*codep = code;
 
-				return 0;
-			}
-		}
-	}
-
-	return -1;
+	return 0;
 }
 
 /* 
@@ -213,9 +191,22 @@ static int utf8_strlen(const char *s)
 	return n;
 }
 
-static void macro_add(struct macro *m, uint8_t type, uint16_t data)
+/*
+ * A parsed (but not yet compiled) macro.
+ */
+struct macro_source {
+	struct macro_entry *entries;
+	size_t sz;
+	size_t cap;
+};
+
+static void macro_add(struct macro_source *m, uint8_t type, uint16_t data)
 {
-	assert(m->sz < MAX_MACRO_SIZE);
+	if (m->sz == m->cap) {
+		m->cap = m->cap ? m->cap * 2 : 16;
+		m->entries = realloc(m->entries, m->cap * sizeof(struct macro_entry));
+		assert(m->entries);
+	}
 
 	m->entries[m->sz].type = type;
 	m->entries[m->sz].data = data;
@@ -223,7 +214,7 @@ static void macro_add(struct macro *m, uint8_t type, uint16_t data)
 	m->sz++;
 }
 
-static int do_parse_macro(struct macro *macro, char *s)
+static int do_parse_macro(struct macro_source *macro, char *s)
 {
 	char *tok;
 	macro->sz = 0;
@@ -253,24 +244,16 @@ static int do_parse_macro(struct macro *macro, char *s)
 			int chrsz;
 
 			while ((chrsz=utf8_read_char(tok, &codepoint))) {
-				int i;
 				int xcode;
 
 				if (chrsz == 1 && codepoint < 128) {
-					for (i = 0; i < 256; i++) {
-						const char *name = keycode_table[i].name;
-						const char *shiftname = keycode_table[i].shifted_name;
-
-						if (name && name[0] == tok[0] && name[1] == 0) {
-							macro_add(macro, MACRO_KEYSEQUENCE, i);
-							break;
-						}
-
-						if (shiftname && shiftname[0] == tok[0] && shiftname[1] == 0) {
-							macro_add(macro, MACRO_KEYSEQUENCE, (MOD_SHIFT << 8) | i);
-							break;
-						}
-					}
+					char name[2] = { tok[0], 0 };
+					uint8_t code;
+					int shifted;
+
+					if (!lookup_keycode(name, &code, &shifted))
+						macro_add(macro, MACRO_KEYSEQUENCE,
+							  (shifted ? MOD_SHIFT << 8 : 0) | code);
 				} else if ((xcode = lookup_xcompose_code(codepoint)) > 0)
 					macro_add(macro, MACRO_UNICODE, xcode);
 
@@ -326,7 +309,131 @@ static size_t escape(char *s)
 }
 
 
-static int parse_macro(const char *exp, struct macro *macro)
+static int add_event(struct layer_table *lt, uint8_t code, uint8_t flags)
+{
+	struct macro_event *ev;
+
+	if (layer_table_reserve(lt, POOL_MACRO_EVENTS, 1) < 0)
+		return -1;
+
+	ev = &lt->macro_events[lt->nr_macro_events++];
+
+	ev->code = code;
+	ev->flags = flags;
+	ev->delay = 0;
+
+	return 0;
+}
+
+static int add_mod_events(struct layer_table *lt, uint8_t mods, uint8_t flags)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_MOD; i++)
+		if (modifier_table[i].mask & mods &&
+		    add_event(lt, modifier_table[i].code1, MACRO_EVENT_MOD | flags) < 0)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Compile the parsed macro into a flat sequence of output events appended to
+ * the macro event pool so that execution doesn't have to reinterpret it.
+ * Modifier transitions are emitted as MACRO_EVENT_MOD events which are
+ * subject to the same reference counting as other modifiers at execution time.
+ */
+static int compile_macro(struct layer_table *lt, const struct macro_source *src, struct macro *macro)
+{
+	size_t i;
+	size_t start = lt->nr_macro_events;
+	int hold_start = -1;
+
+	for (i = 0; i < src->sz; i++) {
+		const struct macro_entry *ent = &src->entries[i];
+
+		switch (ent->type) {
+		size_t j;
+		uint16_t n;
+		uint8_t code, mods;
+		int ret;
+
+		case MACRO_HOLD:
+			if (hold_start == -1)
+				hold_start = i;
+
+			if (add_event(lt, ent->data, MACRO_EVENT_PRESSED) < 0)
+				goto fail;
+			break;
+		case MACRO_RELEASE:
+			if (hold_start != -1) {
+				for (j = hold_start; j < i; j++)
+					if (add_event(lt, src->entries[j].data, 0) < 0)
+						goto fail;
+
+				hold_start = -1;
+			}
+			break;
+		case MACRO_UNICODE:
+			n = ent->data;
+
+			if (add_event(lt, KEYD_LINEFEED, MACRO_EVENT_PRESSED) < 0 ||
+			    add_event(lt, KEYD_LINEFEED, 0) < 0)
+				goto fail;
+
+			for (j = 10000; j; j /= 10) {
+				int digit = n / j;
+				code = digit == 0 ? KEYD_0 : digit - 1 + KEYD_1;
+
+				if (add_event(lt, code, MACRO_EVENT_PRESSED) < 0 ||
+				    add_event(lt, code, 0) < 0)
+					goto fail;
+
+				n %= j;
+			}
+			break;
+		case MACRO_KEYSEQUENCE:
+			code = ent->data;
+			mods = ent->data >> 8;
+
+			ret = add_event(lt, code, MACRO_EVENT_RESET) ||
+			      add_mod_events(lt, mods, MACRO_EVENT_PRESSED) ||
+			      add_event(lt, code, MACRO_EVENT_PRESSED) ||
+			      add_event(lt, code, 0) ||
+			      add_mod_events(lt, mods, 0);
+
+			if (ret)
+				goto fail;
+			break;
+		case MACRO_TIMEOUT:
+			/* Leading or consecutive timeouts require a noop event. */
+			if (lt->nr_macro_events == start ||
+			    lt->macro_events[lt->nr_macro_events-1].delay) {
+				if (add_event(lt, 0, 0) < 0)
+					goto fail;
+			}
+
+			lt->macro_events[lt->nr_macro_events-1].delay = ent->data;
+			break;
+		}
+	}
+
+	macro->start = start;
+	macro->sz = lt->nr_macro_events - start;
+
+	if (src->sz == 1 && src->entries[0].type == MACRO_KEYSEQUENCE)
+		macro->mods = src->entries[0].data >> 8;
+	else
+		macro->mods = 0;
+
+	return 0;
+
+fail:
+	lt->nr_macro_events = start;
+	return -1;
+}
+
+static int parse_macro(const char *exp, struct macro_source *macro)
 {
 	char s[MAX_MACROEXP_LEN];
 	int len = strlen(exp);
@@ -370,46 +477,218 @@ static int lookup_keycodes(const char *name, uint8_t *code1, uint8_t *code2)
 		}
 	}
 
-	for (i = 0; i < 256; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
+	if (lookup_keycode(name, code1, NULL) < 0)
+		return -1;
+
+	*code2 = 0;
+	return 0;
+}
+
+/*
+ * Bind the chord described by `keystr` (of the form <key1>+<key2>...)
+ * within the given layer, replacing any existing binding for the same
+ * set of keys.
+ */
+/* Add a chord, replacing any existing chord with the same keys and layer. */
+static int set_chord(struct layer_table *lt, const struct chord *chord)
+{
+	size_t i;
 
-		if (ent->name &&
-		    (!strcmp(ent->name, name) ||
-		     (ent->alt_name && !strcmp(ent->alt_name, name)))) {
-			*code1 = i;
-			*code2 = 0;
+	for (i = 0; i < lt->nr_chords; i++) {
+		struct chord *c = &lt->chords[i];
 
+		if (c->layer == chord->layer && keyset_equal(&c->keys, &chord->keys)) {
+			*c = *chord;
 			return 0;
 		}
 	}
 
-	return -1;
+	if (layer_table_reserve(lt, POOL_CHORDS, 1) < 0)
+		return -1;
+
+	lt->chords[lt->nr_chords++] = *chord;
+	return 0;
 }
 
-int layer_table_lookup(const struct layer_table *lt, const char *name)
+static int add_chord(struct layer_table *lt, int layer, char *keystr, const char *descstr)
 {
-	size_t i;
+	size_t i, j;
+	size_t n = 0;
+	char *key, *saveptr;
+	uint8_t codes[MAX_CHORD_KEYS][2];
+	struct chord chord = {0};
 
-	for (i = 0; i < lt->nr; i++)
-		if (!strcmp(lt->layers[i].name, name))
-			return i;
+	for (key = strtok_r(keystr, "+", &saveptr); key; key = strtok_r(NULL, "+", &saveptr)) {
+		uint8_t code1, code2;
 
-	return -1;
+		if (lookup_keycodes(key, &code1, &code2) < 0) {
+			err("%s is not a valid key.", key);
+			return -1;
+		}
+
+		if (n == MAX_CHORD_KEYS) {
+			err("max chord keys (%d) exceeded", MAX_CHORD_KEYS);
+			return -1;
+		}
+
+		codes[n][0] = code1;
+		codes[n][1] = code2;
+		n++;
+	}
+
+	if (n < 2) {
+		err("a chord must consist of two or more keys.");
+		return -1;
+	}
+
+	if (parse_descriptor(descstr, &chord.d, lt) < 0)
+		return -1;
+
+	chord.layer = layer;
+
+	/*
+	 * A modifier name (e.g 'control') matches either of its keys, so a
+	 * chord is added for every combination of the alternatives.
+	 */
+	for (i = 0; i < (1u << n); i++) {
+		memset(&chord.keys, 0, sizeof chord.keys);
+
+		for (j = 0; j < n; j++) {
+			if (!(i & (1u << j)))
+				keyset_add(&chord.keys, codes[j][0]);
+			else if (codes[j][1])
+				keyset_add(&chord.keys, codes[j][1]);
+			else
+				break;
+		}
+
+		if (j == n && set_chord(lt, &chord) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Report a reference to a layer which does not exist. */
+static void invalid_layer(const char *name)
+{
+	if (!strcmp(name, "leader")) {
+		err("leader is reserved for leader() sequences and is not a valid layer.");
+	} else {
+		err("%s is not a valid layer.", name);
+	}
 }
 
 /*
- * Consumes a string of the form `[<layer>.]<key> = <descriptor>` and adds the
- * mapping to the corresponding layer in the layer_table.
+ * Add the leader() sequence described by `keystr` (of the form
+ * <key1> [<key2>...]) to the trie, replacing any existing binding.
  */
+/* Find or create the child of the given leader node for `code`, 0 on failure. */
+static uint16_t leader_child(struct layer_table *lt, uint16_t node, uint8_t code)
+{
+	uint16_t child;
+	uint16_t last = 0;
+	struct leader_node *ln;
 
-int layer_table_add_entry(struct layer_table *lt, const char *exp)
+	for (child = lt->leader_nodes[node].child; child; child = lt->leader_nodes[child].next) {
+		if (lt->leader_nodes[child].code == code)
+			return child;
+
+		last = child;
+	}
+
+	if (layer_table_reserve(lt, POOL_LEADER_NODES, 1) < 0)
+		return 0;
+
+	child = lt->nr_leader_nodes++;
+	ln = &lt->leader_nodes[child];
+
+	ln->code = code;
+	ln->child = 0;
+	ln->next = 0;
+	ln->d.op = OP_UNDEFINED;
+	ln->d.prog = 0;
+
+	if (last)
+		lt->leader_nodes[last].next = child;
+	else
+		lt->leader_nodes[node].child = child;
+
+	return child;
+}
+
+/*
+ * Bind `d` to the end of every path through the trie which spells out the
+ * remaining keys, branching wherever a key has a second code (e.g the
+ * right hand key of 'control').
+ */
+static int insert_sequence(struct layer_table *lt, uint16_t node,
+			   uint8_t (*codes)[2], size_t n, const struct descriptor *d)
 {
-	uint8_t code1, code2;
-	char *keystr, *descstr, *c, *s;
-	char *layername = "main";
+	size_t i;
+
+	if (!n) {
+		lt->leader_nodes[node].d = *d;
+		return 0;
+	}
+
+	for (i = 0; i < 2 && codes[0][i]; i++) {
+		uint16_t child = leader_child(lt, node, codes[0][i]);
+
+		if (!child || insert_sequence(lt, child, codes + 1, n - 1, d) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int add_sequence(struct layer_table *lt, char *keystr, const char *descstr)
+{
+	size_t n = 0;
+	char *key, *saveptr;
+	uint8_t codes[MAX_LEADER_KEYS][2];
 	struct descriptor d;
-	struct layer *layer;
-	int idx;
+
+	for (key = strtok_r(keystr, " ", &saveptr); key; key = strtok_r(NULL, " ", &saveptr)) {
+		if (n == MAX_LEADER_KEYS) {
+			err("max leader sequence length (%d) exceeded", MAX_LEADER_KEYS);
+			return -1;
+		}
+
+		if (lookup_keycodes(key, &codes[n][0], &codes[n][1]) < 0) {
+			err("%s is not a valid key.", key);
+			return -1;
+		}
+
+		n++;
+	}
+
+	if (!n) {
+		err("empty leader sequence.");
+		return -1;
+	}
+
+	if (parse_descriptor(descstr, &d, lt) < 0)
+		return -1;
+
+	if (!lt->nr_leader_nodes) {
+		if (layer_table_reserve(lt, POOL_LEADER_NODES, 1) < 0)
+			return -1;
+
+		lt->nr_leader_nodes = 1;
+	}
+
+	return insert_sequence(lt, 0, codes, n, &d);
+}
+
+/*
+ * Split an expression of the form `[<layer>.]<key> = <descriptor>` into its
+ * constituent parts. The returned strings are only valid until the next
+ * call.
+ */
+static int split_exp(const char *exp, char **layername, char **keystr, char **descstr)
+{
+	char *c, *s;
 
 	static char buf[MAX_EXP_LEN];
 
@@ -421,17 +700,43 @@ int layer_table_add_entry(struct layer_table *lt, const char *exp)
 	strcpy(buf, exp);
 	s = buf;
 
+	*layername = "main";
+
 	if ((c = strchr(s, '.'))) {
-		layername = s;
+		*layername = s;
 		*c = 0;
 		s = c+1;
 	}
 
-	if (parse_kvp(s, &keystr, &descstr) < 0) {
+	if (parse_kvp(s, keystr, descstr) < 0) {
 		err("Invalid key value pair.");
 		return -1;
 	}
 
+	return 0;
+}
+
+/*
+ * Consumes a string of the form `[<layer>.]<key>[+<key>...] = <descriptor>` and
+ * adds the mapping to the corresponding layer in the layer_table.
+ */
+
+int layer_table_add_entry(struct layer_table *lt, const char *exp)
+{
+	uint8_t code1, code2;
+	char *keystr, *descstr;
+	char *layername;
+	struct descriptor d;
+	struct layer *layer;
+	int idx;
+
+	if (split_exp(exp, &layername, &keystr, &descstr) < 0)
+		return -1;
+
+	/* Sequences bound in the special leader section. */
+	if (!strcmp(layername, "leader"))
+		return add_sequence(lt, keystr, descstr);
+
 	idx = layer_table_lookup(lt, layername);
 
 	if (idx == -1) {
@@ -441,6 +746,9 @@ int layer_table_add_entry(struct layer_table *lt, const char *exp)
 
 	layer = &lt->layers[idx];
 
+	if (strchr(keystr, '+') && keystr[1])
+		return add_chord(lt, idx, keystr, descstr);
+
 	if (lookup_keycodes(keystr, &code1, &code2) < 0) {
 		err("%s is not a valid key.", keystr);
 		return -1;
@@ -450,14 +758,48 @@ int layer_table_add_entry(struct layer_table *lt, const char *exp)
 		return -1;
 
 	if (code1)
-		layer->keymap[code1] = d;
+		layer_table_bind(lt, layer, code1, &d);
 
 	if (code2)
-		layer->keymap[code2] = d;
+		layer_table_bind(lt, layer, code2, &d);
 
 	return 0;
 }
 
+/*
+ * Like layer_table_add_entry(), but stores the result in `b` instead of
+ * modifying the keymap. Storage required by the descriptor (e.g macros) is
+ * still allocated from the table, which may be an extension of a packed one
+ * (see layer_table_extend()). Chords and leader sequences are not supported.
+ */
+int layer_table_parse_binding(struct layer_table *lt, const char *exp, struct binding *b)
+{
+	char *keystr, *descstr;
+	char *layername;
+
+	if (split_exp(exp, &layername, &keystr, &descstr) < 0)
+		return -1;
+
+	if (!strcmp(layername, "leader") || (strchr(keystr, '+') && keystr[1])) {
+		err("chords and leader sequences cannot be bound at runtime.");
+		return -1;
+	}
+
+	b->layer = layer_table_lookup(lt, layername);
+
+	if (b->layer == -1) {
+		err("%s is not a valid layer", layername);
+		return -1;
+	}
+
+	if (lookup_keycodes(keystr, &b->code1, &b->code2) < 0) {
+		err("%s is not a valid key.", keystr);
+		return -1;
+	}
+
+	return parse_descriptor(descstr, &b->d, lt);
+}
+
 /*
  * Populate the provided layer described by `desc`, which is a string of the
  * form "<layer>[:<type>]".  The provided layer table is used to look up
@@ -488,7 +830,7 @@ int create_layer(struct layer *layer, const char *desc, const struct layer_table
 	if (strchr(name, '+')) {
 		char *layern;
 		int n = 0;
-		int layers[MAX_COMPOSITE_LAYERS];
+		int layers[MAX_COMPOSITE_LAYERS] = {0};
 
 		if (modstr) {
 			err("composite layers cannot have a modifier set.");
@@ -498,7 +840,7 @@ int create_layer(struct layer *layer, const char *desc, const struct layer_table
 		for (layern = strtok(name, "+"); layern; layern = strtok(NULL, "+")) {
 			int idx = layer_table_lookup(lt, layern);
 			if (idx < 0) {
-				err("%s is not a valid layer", layern);
+				invalid_layer(layern);
 				return -1;
 			}
 
@@ -538,30 +880,206 @@ int create_layer(struct layer *layer, const char *desc, const struct layer_table
  */
 int set_macro_arg(struct descriptor *d, int idx, struct layer_table *lt, const char *exp)
 {
-	if (lt->nr_macros >= MAX_MACROS) {
-		err("max macros (%d), exceeded", MAX_MACROS);
-		return 1;
-	}
+	static struct macro_source src;
+	int ret;
 
-	if (parse_macro(exp, &lt->macros[lt->nr_macros]) < 0) {
+	if (parse_macro(exp, &src) < 0) {
 		err("\"%s\" is not a valid macro", exp);
 		return -1;
 	}
 
-	d->args[idx].idx = lt->nr_macros;
+	if (layer_table_reserve(lt, POOL_MACROS, 1) < 0)
+		return 1;
 
-	lt->nr_macros++;
+	if (compile_macro(lt, &src, &lt->macros[lt->nr_macros]) < 0)
+		return 1;
+
+	if ((ret = layer_table_add_macro(lt)) < 0)
+		return 1;
+
+	d->args[idx].idx = ret;
 
 	return 0;
 }
 
+struct program {
+	uint8_t code[32];
+	size_t sz;
+};
+
+static void emit(struct program *p, uint8_t b)
+{
+	p->code[p->sz++] = b;
+}
+
+static void emit16(struct program *p, uint16_t v)
+{
+	emit(p, v & 0xff);
+	emit(p, v >> 8);
+}
+
+/* Emit a jump and return the location of its offset. */
+static size_t emit_jmp(struct program *p, uint8_t op)
+{
+	emit(p, op);
+	emit(p, 0);
+
+	return p->sz - 1;
+}
+
+/* Point the jump at `loc` to the end of the program. */
+static void set_label(struct program *p, size_t loc)
+{
+	p->code[loc] = p->sz - loc - 1;
+}
+
 /*
- * Modifies the input string. Layers names within the descriptor
- * are resolved using the provided layer table.
+ * Compile the descriptor into the bytecode pool and store the offset of the
+ * resulting program in d->prog. The first program in the pool is always
+ * the one for OP_UNDEFINED.
  */
-int parse_descriptor(const char *descstr,
-		     struct descriptor *d,
-		     struct layer_table *lt)
+int compile_descriptor(struct layer_table *lt, struct descriptor *d)
+{
+	struct program p = {0};
+	size_t rel, tap;
+
+	if (!lt->nr_bytecode && d->op != OP_UNDEFINED) {
+		struct descriptor undefined = { .op = OP_UNDEFINED };
+
+		if (compile_descriptor(lt, &undefined) < 0)
+			return -1;
+	}
+
+	switch (d->op) {
+	case OP_UNDEFINED:
+		if (lt->nr_bytecode) {
+			d->prog = 0;
+			return 0;
+		}
+
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_CLEAR_ONESHOT);
+		set_label(&p, rel);
+		emit(&p, I_END);
+		break;
+	case OP_KEYCODE:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_KEY_DOWN);
+		emit(&p, d->args[0].code);
+		emit(&p, I_RESET_LATCH);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		emit(&p, I_KEY_UP);
+		emit(&p, d->args[0].code);
+		emit(&p, I_CLEAR_ONESHOT);
+		emit(&p, I_END);
+		break;
+	case OP_MACRO:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_MACRO);
+		emit16(&p, d->args[0].idx);
+		emit(&p, I_REPEAT);
+		emit16(&p, d->args[0].idx);
+		set_label(&p, rel);
+		emit(&p, I_RESET_LATCH);
+		emit(&p, I_CLEAR_ONESHOT);
+		emit(&p, I_END);
+		break;
+	case OP_ONESHOT:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_ONESHOT_DOWN);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		emit(&p, I_ONESHOT_UP);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		break;
+	case OP_TOGGLE:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_CLEAR_ONESHOT);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		emit(&p, I_TOGGLE);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_CLEAR_ONESHOT);
+		emit(&p, I_END);
+		break;
+	case OP_LAYER:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_LAYER_ON);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		tap = emit_jmp(&p, I_JMP_TAP);
+		emit(&p, I_LAYER_OFF_DISARM);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		set_label(&p, tap);
+		emit(&p, I_LAYER_OFF);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		break;
+	case OP_SWAP:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_SWAP);
+		emit(&p, d->args[0].idx);
+		emit16(&p, d->args[1].idx);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		emit(&p, I_LAYER_OFF_DISARM);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_END);
+		break;
+	case OP_OVERLOAD:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_LAYER_ON);
+		emit(&p, d->args[0].idx);
+		emit(&p, I_LOOKAHEAD);
+		emit(&p, I_END);
+		set_label(&p, rel);
+		emit(&p, I_LAYER_OFF_DISARM);
+		emit(&p, d->args[0].idx);
+		tap = emit_jmp(&p, I_JMP_TAP);
+		emit(&p, I_END);
+		set_label(&p, tap);
+		if (d->args[1].idx != 0xffff) {
+			emit(&p, I_MACRO);
+			emit16(&p, d->args[1].idx);
+		}
+		emit(&p, I_RESET_LATCH);
+		emit(&p, I_CLEAR_ONESHOT);
+		emit(&p, I_END);
+		break;
+	case OP_TIMEOUT:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_TIMEOUT);
+		emit16(&p, d->args[0].idx);
+		set_label(&p, rel);
+		emit(&p, I_END);
+		break;
+	case OP_LEADER:
+		rel = emit_jmp(&p, I_JMP_RELEASED);
+		emit(&p, I_LEADER);
+		set_label(&p, rel);
+		emit(&p, I_END);
+		break;
+	}
+
+	if (layer_table_reserve(lt, POOL_BYTECODE, p.sz) < 0)
+		return -1;
+
+	d->prog = lt->nr_bytecode;
+
+	memcpy(&lt->bytecode[lt->nr_bytecode], p.code, p.sz);
+	lt->nr_bytecode += p.sz;
+
+	return 0;
+}
+
+static int do_parse_descriptor(const char *descstr,
+			       struct descriptor *d,
+			       struct layer_table *lt)
 {
 	char *fn = NULL;
 	char *args[MAX_ARGS];
@@ -605,6 +1123,14 @@ int parse_descriptor(const char *descstr,
 			d->op = OP_SWAP;
 		} else if (!strcmp(fn, "timeout")) {
 			d->op = OP_TIMEOUT;
+		} else if (!strcmp(fn, "leader")) {
+			if (nargs > 1 || args[0][0]) {
+				err("leader does not accept arguments.");
+				return -1;
+			}
+
+			d->op = OP_LEADER;
+			return 0;
 		} else {
 			err("\"%s\" is not a valid action or macro.", descstr);
 			return -1;
@@ -617,38 +1143,45 @@ int parse_descriptor(const char *descstr,
 
 		if (d->op == OP_TIMEOUT) {
 			struct timeout *timeout;
+			struct descriptor d1 = {0}, d2 = {0};
 
 			if (nargs != 3) {
 				err("timeout requires 3 arguments.");
 				return -1;
 			}
 
-			d->op = OP_TIMEOUT;
-			d->args[0].idx = lt->nr_timeouts;
+			/*
+			 * The arguments may themselves contain timeouts, so
+			 * the slot is only claimed once they are parsed.
+			 */
+			if (parse_descriptor(args[0], &d1, lt) < 0)
+				return -1;
 
-			if (lt->nr_timeouts >= MAX_TIMEOUTS) {
-				err("max timeouts (%d) exceeded", MAX_TIMEOUTS);
+			if (parse_descriptor(args[2], &d2, lt) < 0)
+				return -1;
+
+			if (layer_table_reserve(lt, POOL_TIMEOUTS, 1) < 0)
 				return -1;
-			}
 
 			timeout = &lt->timeouts[lt->nr_timeouts];
 
-			if (parse_descriptor(args[0], &timeout->d1, lt) < 0)
-				return -1;
+			timeout->d1 = d1;
+			timeout->d2 = d2;
+			timeout->timeout = atoi(args[1]);
 
-			if (parse_descriptor(args[2], &timeout->d2, lt) < 0)
+			if ((ret = layer_table_add_timeout(lt)) < 0)
 				return -1;
 
-			timeout->timeout = atoi(args[1]);
+			d->op = OP_TIMEOUT;
+			d->args[0].idx = ret;
 
-			lt->nr_timeouts++;
 			return 0;
 		}
 
 		idx = layer_table_lookup(lt, args[0]);
 
 		if (idx == -1) {
-			err("%s is not a valid layer.", args[0]);
+			invalid_layer(args[0]);
 			return -1;
 		}
 
@@ -671,3 +1204,17 @@ int parse_descriptor(const char *descstr,
 
 	return 0;
 }
+
+/*
+ * Modifies the input string. Layers names within the descriptor
+ * are resolved using the provided layer table.
+ */
+int parse_descriptor(const char *descstr,
+		     struct descriptor *d,
+		     struct layer_table *lt)
+{
+	if (do_parse_descriptor(descstr, d, lt) < 0)
+		return -1;
+
+	return compile_descriptor(lt, d);
+}
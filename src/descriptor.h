@@ -12,7 +12,8 @@
 struct layer;
 struct layer_table;
 
-#define MAX_LAYERS 32
+/* Limited by the 8 bit layer operands of compiled descriptors. */
+#define MAX_LAYERS 256
 #define MAX_EXP_LEN 512
 #define MAX_MACROEXP_LEN 512
 
@@ -29,7 +30,42 @@ enum op {
 	OP_TOGGLE,
 
 	OP_MACRO,
-	OP_TIMEOUT
+	OP_TIMEOUT,
+	OP_LEADER
+};
+
+/*
+ * Descriptors are compiled into small programs within the layer table's
+ * bytecode pool, which are run on both the depression and release of the
+ * key. Each instruction consists of an opcode followed by its operands
+ * (16 bit operands are little endian).
+ */
+enum instruction {
+	I_END,
+
+	I_JMP_RELEASED,		/* <offset>: Skip <offset> bytes if the key is being released. */
+	I_JMP_TAP,		/* <offset>: Skip <offset> bytes if the key was the last one struck. */
+
+	I_LAYER_ON,		/* <layer> */
+	I_LAYER_OFF,		/* <layer> */
+	I_LAYER_OFF_DISARM,	/* <layer>: Deactivate without emitting modifier releases. */
+
+	I_KEY_DOWN,		/* <code> */
+	I_KEY_UP,		/* <code> */
+
+	I_MACRO,		/* <macro16> */
+	I_REPEAT,		/* <macro16>: Schedule the repetition of a macro. */
+
+	I_ONESHOT_DOWN,		/* <layer> */
+	I_ONESHOT_UP,		/* <layer> */
+	I_TOGGLE,		/* <layer> */
+	I_SWAP,			/* <layer> <macro16> */
+	I_TIMEOUT,		/* <timeout16> */
+	I_LEADER,
+	I_LOOKAHEAD,		/* Defer subsequent keys until tap/hold is known. */
+
+	I_CLEAR_ONESHOT,
+	I_RESET_LATCH,
 };
 
 /* Describes the intended purpose of a key. */
@@ -39,10 +75,24 @@ struct descriptor {
 
 	union {
 		uint8_t code;
-		int16_t idx;
+		uint16_t idx;
 		uint16_t sz;
 		uint16_t timeout;
 	} args[3];
+
+	/* Offset of the compiled program (0 corresponds to OP_UNDEFINED). */
+	uint16_t prog;
+};
+
+/* A key binding within a layer. */
+
+struct binding {
+	int layer;
+
+	uint8_t code1;
+	uint8_t code2;
+
+	struct descriptor d;
 };
 
 /*
@@ -54,8 +104,10 @@ int parse_descriptor(const char *descstr,
 		     struct descriptor *d,
 		     struct layer_table *lt);
 
+int compile_descriptor(struct layer_table *lt, struct descriptor *d);
+
 int layer_table_add_entry(struct layer_table *lt, const char *exp);
-int layer_table_lookup(const struct layer_table *lt, const char *name);
+int layer_table_parse_binding(struct layer_table *lt, const char *exp, struct binding *b);
 
 int create_layer(struct layer *layer, const char *desc, const struct layer_table *lt);
 #endif
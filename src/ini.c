@@ -65,7 +65,7 @@ int parse_kvp(char *s, char **key, char **value)
 	return -1;
 }
 
-static void read_file(const char *path, char *buf, size_t buf_sz)
+static int read_file(const char *path, char *buf, size_t buf_sz)
 {
 	struct stat st;
 	size_t sz;
@@ -78,7 +78,10 @@ static void read_file(const char *path, char *buf, size_t buf_sz)
 	}
 
 	sz = st.st_size;
-	assert(sz < buf_sz);
+	if (sz >= buf_sz) {
+		fprintf(stderr, "ERROR %s: exceeds the maximum size of %zu bytes\n", path, buf_sz - 1);
+		return -1;
+	}
 
 	fd = open(path, O_RDONLY);
 	while ((nr = read(fd, buf + n, sz - n))) {
@@ -87,14 +90,35 @@ static void read_file(const char *path, char *buf, size_t buf_sz)
 
 	buf[sz] = '\0';
 	close(fd);
+
+	return 0;
 }
 
-int parse(char *s, struct ini *ini, const char *default_section_name)
+/* Returns a new section at the end of ini->sections, or NULL on failure. */
+static struct ini_section *add_section(struct ini *ini, size_t n)
+{
+	if (n == ini->cap) {
+		size_t cap = ini->cap ? ini->cap * 2 : 16;
+		struct ini_section *sections = realloc(ini->sections, cap * sizeof(struct ini_section));
+
+		if (!sections)
+			return NULL;
+
+		ini->sections = sections;
+		ini->cap = cap;
+	}
+
+	return &ini->sections[n];
+}
+
+/* `path` is only used for diagnostics. */
+static int parse(char *s, struct ini *ini, const char *default_section_name, const char *path)
 {
 	int ln = 0;
 	size_t n = 0;
 
 	struct ini_section *section = NULL;
+	size_t truncated = 0; /* The number of the last section to overflow. */
 
 	while (s) {
 		size_t len;
@@ -128,13 +152,12 @@ int parse(char *s, struct ini *ini, const char *default_section_name)
 		switch (line[0]) {
 		case '[':
 			if (line[len-1] == ']') {
-				assert(n < MAX_SECTIONS);
-
-				section = &ini->sections[n++];
+				if (!(section = add_section(ini, n++)))
+					return -1;
 
 				line[len-1] = 0;
 
-				strncpy(section->name, line+1, sizeof(section->name));
+				snprintf(section->name, sizeof(section->name), "%s", line+1);
 				section->nr_entries = 0;
 				section->lnum = ln;
 
@@ -148,7 +171,9 @@ int parse(char *s, struct ini *ini, const char *default_section_name)
 
 		if (!section) {
 			if(default_section_name) {
-				section = &ini->sections[n++];
+				if (!(section = add_section(ini, n++)))
+					return -1;
+
 				strcpy(section->name, default_section_name);
 
 				section->nr_entries = 0;
@@ -157,7 +182,14 @@ int parse(char *s, struct ini *ini, const char *default_section_name)
 				return -1;
 		}
 
-		assert(section->nr_entries < MAX_SECTION_ENTRIES);
+		if (section->nr_entries == MAX_SECTION_ENTRIES) {
+			if (truncated != n)
+				fprintf(stderr, "ERROR %s:%d: [%s] exceeds the maximum of %d entries, ignoring the remainder\n",
+					path, ln, section->name, MAX_SECTION_ENTRIES);
+
+			truncated = n;
+			continue;
+		}
 
 		ent = &section->entries[section->nr_entries++];
 
@@ -178,8 +210,8 @@ struct ini *ini_parse_file(const char *path, const char *default_section_name)
 	static char buf[MAX_INI_SIZE];
 	static struct ini ini;
 
-	read_file(path, buf, sizeof buf);
-	if (parse(buf, &ini, default_section_name) < 0)
+	if (read_file(path, buf, sizeof buf) < 0 ||
+	    parse(buf, &ini, default_section_name, path) < 0)
 		return NULL;
 
 	return &ini;
@@ -8,7 +8,6 @@
 
 #include <stdint.h>
 
-#define MAX_SECTIONS 32
 #define MAX_SECTION_ENTRIES 128
 
 struct ini_entry {
@@ -28,7 +27,9 @@ struct ini_section {
 struct ini {
 	size_t nr_sections;
 
-	struct ini_section sections[MAX_SECTIONS];
+	/* Grown on demand, the allocation is reused by subsequent parses. */
+	struct ini_section *sections;
+	size_t cap;
 };
 
 /*
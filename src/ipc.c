@@ -109,6 +109,91 @@ void ipc_server_process_connection(int sd, int (*handler) (int output_fd, const
 	close(sd);
 }
 
+/*
+ * Pass a file descriptor to the client on the other end of the connection.
+ * Intended to be called from within an ipc_server_process_connection()
+ * handler, the client should use ipc_recv_fd().
+ */
+int ipc_send_fd(int sd, int fd)
+{
+	char c = 0;
+	char buf[CMSG_SPACE(sizeof fd)];
+	struct iovec iov = { &c, 1 };
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+
+	memset(buf, 0, sizeof buf);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof buf;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+	if (sendmsg(sd, &msg, 0) < 0) {
+		perror("sendmsg");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Like ipc_run(), but expects the server to pass back a file descriptor
+ * (see ipc_send_fd()). Returns the descriptor or -1 on failure.
+ */
+int ipc_recv_fd(const char *socket, const char *input)
+{
+	int n;
+	int fd = -1;
+	char c;
+	char buf[CMSG_SPACE(sizeof fd)];
+	char out[MAX_MESSAGE_SIZE];
+	struct iovec iov = { &c, 1 };
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+
+	int sd = client_connect(socket);
+
+	if (sd < 0)
+		return -1;
+
+	write(sd, input, strlen(input));
+	write(sd, "\x00\x00", 2);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof buf;
+
+	if (recvmsg(sd, &msg, 0) < 0) {
+		perror("recvmsg");
+		close(sd);
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+	/* Drain the remainder of the response. */
+	n = readmsg(sd, out);
+	close(sd);
+
+	if (n < 1 || out[n-1]) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 int ipc_run(const char *socket, const char *input)
 {	
 	int n;
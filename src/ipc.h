@@ -27,4 +27,7 @@ int	ipc_create_server(const char *path);
 void	ipc_server_process_connection(int sd, int (*handler) (int fd, const char *input));
 int	ipc_run(const char *socket, const char *input);
 
+int	ipc_send_fd(int sd, int fd);
+int	ipc_recv_fd(const char *socket, const char *input);
+
 #endif
@@ -6,25 +6,62 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "keyboard.h"
 #include "keyd.h"
 #include "vkbd.h"
 #include "descriptor.h"
 #include "layer.h"
+#include "profile.h"
 
-static struct macro *active_macro = NULL;
-static uint8_t active_macro_mods = 0;
-static uint8_t oneshot_latch = 0;
+static long monotonic_now(const struct kbd_clock *clock)
+{
+	struct timespec ts;
+
+	(void)clock;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E3+ts.tv_nsec/1E6;
+}
+
+static long simulated_now(const struct kbd_clock *clock)
+{
+	return clock->time;
+}
+
+const struct kbd_clock kbd_monotonic_clock = { monotonic_now, 0 };
+
+void kbd_simulated_clock(struct kbd_clock *clock, long time)
+{
+	clock->now = simulated_now;
+	clock->time = time;
+}
+
+static long kbd_now(struct keyboard *kbd)
+{
+	const struct kbd_clock *clock = kbd->clock ? kbd->clock : &kbd_monotonic_clock;
 
-static long get_time()
+	return clock->now(clock);
+}
+
+static void flush_output(struct keyboard *kbd)
 {
-	/* close enough :/. using a syscall is unnecessary. */
-	static long time = 1;
-	return time++;
+	if (kbd->nr_output) {
+		PROFILE_START(start);
+
+		vkbd_send_keys(vkbd, kbd->output, kbd->nr_output);
+		kbd->nr_output = 0;
+
+		PROFILE_END(PROFILE_FLUSH, start);
+	}
 }
 
+/*
+ * Output is buffered and flushed to the virtual keyboard at the end of
+ * kbd_process_key_event() (or whenever the buffer fills up).
+ */
 static void kbd_send_key(struct keyboard *kbd, uint8_t code, uint8_t pressed)
 {
 	if (code == KEYD_NOOP || code == KEYD_EXTERNAL_MOUSE_BUTTON)
@@ -33,20 +70,28 @@ static void kbd_send_key(struct keyboard *kbd, uint8_t code, uint8_t pressed)
 	if (pressed)
 		kbd->last_pressed_output_code = code;
 
-	kbd->keystate[code] = pressed;
+	kbd->state.keystate[code] = pressed;
 
 	switch (code) {
 		case KEYD_LEFT_MOUSE:
+			flush_output(kbd);
 			vkbd_send_button(vkbd, 1, pressed);
 			break;
 		case KEYD_MIDDLE_MOUSE:
+			flush_output(kbd);
 			vkbd_send_button(vkbd, 2, pressed);
 			break;
 		case KEYD_RIGHT_MOUSE:
+			flush_output(kbd);
 			vkbd_send_button(vkbd, 3, pressed);
 			break;
 		default:
-			vkbd_send_key(vkbd, code, pressed);
+			if (kbd->nr_output == MAX_OUTPUT_EVENTS)
+				flush_output(kbd);
+
+			kbd->output[kbd->nr_output].code = code;
+			kbd->output[kbd->nr_output].pressed = pressed;
+			kbd->nr_output++;
 			break;
 	}
 }
@@ -67,11 +112,11 @@ static void send_mods(struct keyboard *kbd, uint8_t mods, int press)
 		uint8_t mask = modifier_table[i].mask;
 
 		if (mask & mods) {
-			kbd->modstate[i] += press ? 1 : -1;
+			kbd->state.modstate[i] += press ? 1 : -1;
 
-			if (kbd->modstate[i] == 0)
+			if (kbd->state.modstate[i] == 0)
 				kbd_send_key(kbd, code, 0);
-			else if (kbd->modstate[i] == 1)
+			else if (kbd->state.modstate[i] == 1)
 				kbd_send_key(kbd, code, 1);
 		}
 	}
@@ -86,7 +131,7 @@ static void disarm_mods(struct keyboard *kbd, uint8_t mods)
 	 * from being interpreted as an alt keypress.
 	 */
 	if (dmods && ((kbd->last_pressed_output_code == KEYD_LEFTMETA) || (kbd->last_pressed_output_code == KEYD_LEFTALT))) {
-		if (kbd->keystate[KEYD_LEFTCTRL])
+		if (kbd->state.keystate[KEYD_LEFTCTRL])
 			send_mods(kbd, dmods, 0);
 		else {
 			kbd_send_key(kbd, KEYD_LEFTCTRL, 1);
@@ -100,11 +145,143 @@ static void disarm_mods(struct keyboard *kbd, uint8_t mods)
 	send_mods(kbd, mods, 0);
 }
 
-static void execute_macro(struct keyboard *kbd, const struct macro *macro, uint8_t disable_mods)
+/*
+ * Timers are kept in a small fixed pool indexed by the set bits of
+ * kbd->active_timers, which makes insertion and cancellation O(1). The index
+ * of the earliest timer is cached and only recomputed (by walking the active
+ * set) after it has been cancelled.
+ */
+
+static int timer_add(struct keyboard *kbd, long deadline, uint8_t type, uint8_t code)
 {
-	size_t i;
-	int hold_start = -1;
+	int i;
+
+	if (kbd->active_timers == (uint32_t)-1)
+		return -1;
+
+	i = __builtin_ctz(~kbd->active_timers);
+
+	kbd->timers[i].deadline = deadline;
+	kbd->timers[i].type = type;
+	kbd->timers[i].code = code;
+
+	if (!kbd->active_timers)
+		kbd->next_timer = i;
+	else if (kbd->next_timer != -1 &&
+		 deadline < kbd->timers[kbd->next_timer].deadline)
+		kbd->next_timer = i;
+
+	kbd->active_timers |= (uint32_t)1 << i;
+
+	return i;
+}
+
+static void timer_cancel(struct keyboard *kbd, int i)
+{
+	if (i < 0 || !(kbd->active_timers & ((uint32_t)1 << i)))
+		return;
+
+	kbd->active_timers &= ~((uint32_t)1 << i);
+
+	if (kbd->next_timer == i)
+		kbd->next_timer = -1;
+}
+
+/* Returns the index of the earliest timer, or -1 if none are active. */
+static int timer_next(struct keyboard *kbd)
+{
+	uint32_t set = kbd->active_timers;
+
+	if (!set)
+		return -1;
+
+	if (kbd->next_timer != -1)
+		return kbd->next_timer;
+
+	while (set) {
+		int i = __builtin_ctz(set);
+
+		if (kbd->next_timer == -1 ||
+		    kbd->timers[i].deadline < kbd->timers[kbd->next_timer].deadline)
+			kbd->next_timer = i;
+
+		set &= set - 1;
+	}
+
+	return kbd->next_timer;
+}
+
+/* Cancel all timers of the given type. */
+static void timer_cancel_type(struct keyboard *kbd, uint8_t type)
+{
+	uint32_t set = kbd->active_timers;
+
+	while (set) {
+		int i = __builtin_ctz(set);
+
+		if (kbd->timers[i].type == type)
+			timer_cancel(kbd, i);
+
+		set &= set - 1;
+	}
+}
+
+/*
+ * Advance the active macro until it either completes or encounters a delay.
+ * Returns the number of milliseconds after which execution should be
+ * resumed, or 0 if the macro has run to completion.
+ */
+static long macro_step(struct keyboard *kbd)
+{
+	const struct macro *macro = kbd->macro_state.macro;
+	const struct macro_event *events = &kbd->macro_state.lt->macro_events[macro->start];
+
+	while (kbd->macro_state.idx < macro->sz) {
+		const struct macro_event *ev = &events[kbd->macro_state.idx++];
+		uint8_t pressed = ev->flags & MACRO_EVENT_PRESSED;
+
+		if (!ev->code) {
+			/* noop (i.e a leading delay) */
+		} else if (ev->flags & MACRO_EVENT_MOD)
+			send_mods(kbd, keycode_to_mod(ev->code), pressed);
+		else if (ev->flags & MACRO_EVENT_RESET) {
+			if (kbd->state.keystate[ev->code])
+				kbd_send_key(kbd, ev->code, 0);
+		} else {
+			kbd_send_key(kbd, ev->code, pressed);
+		}
+
+		if (ev->delay) {
+			kbd->macro_state.timer = timer_add(kbd,
+							   kbd->now + ev->delay,
+							   TIMER_MACRO, 0);
+
+			if (kbd->macro_state.timer != -1)
+				return ev->delay;
+		}
+	}
+
+	send_mods(kbd, kbd->macro_state.mods, 1);
+	kbd->macro_state.macro = NULL;
+
+	if (kbd->macro_state.repeat_timeout && kbd->active_macro)
+		timer_add(kbd, kbd->now + kbd->macro_state.repeat_timeout,
+			  TIMER_MACRO_REPEAT, 0);
+
+	kbd->macro_state.repeat_timeout = 0;
+
+	return 0;
+}
 
+/*
+ * Begin executing the supplied macro (whose events reside in `lt`).
+ * Execution is suspended at each delay and subsequently resumed by
+ * kbd_process_key_event() so that macros never block the main loop. Returns
+ * the value of the initial macro_step().
+ */
+static long execute_macro(struct keyboard *kbd, const struct layer_table *lt,
+			  const struct macro *macro, uint8_t disable_mods)
+{
 	/*
 	 * Minimize unnecessary noise by avoiding redundant modifier key up/down
 	 * events in the case that the requisite modifiers are already present
@@ -119,159 +296,332 @@ static void execute_macro(struct keyboard *kbd, const struct macro *macro, uint8
 	 * less likely to produce undesirable side effects as a consequence of additional
 	 * meta up/down presses.
 	 */
-	if (macro->sz == 1 && macro->entries[0].type == MACRO_KEYSEQUENCE)
-		disable_mods &= ~(macro->entries[0].data >> 8);
+	disable_mods &= ~macro->mods;
+
+	/*
+	 * A timer may begin a macro while another is suspended, in which
+	 * case the latter is completed first so that their output isn't
+	 * interleaved.
+	 */
+	while (kbd->macro_state.macro) {
+		timer_cancel(kbd, kbd->macro_state.timer);
+		macro_step(kbd);
+	}
 
 	disarm_mods(kbd, disable_mods);
 
-	for (i = 0; i < macro->sz; i++) {
-		const struct macro_entry *ent = &macro->entries[i];
+	kbd->macro_state.macro = macro;
+	kbd->macro_state.lt = lt;
+	kbd->macro_state.idx = 0;
+	kbd->macro_state.mods = disable_mods;
+	kbd->macro_state.repeat_timeout = 0;
+
+	return macro_step(kbd);
+}
+
+/*
+ * Schedule the next repetition of the active macro relative to the
+ * completion of the current execution.
+ */
+static void schedule_repeat(struct keyboard *kbd, long timeout)
+{
+	/* A repeat timeout of 0 disables repetition. */
+	if (timeout <= 0)
+		return;
 
-		switch (ent->type) {
-		size_t j;
-		uint16_t n;
-		uint8_t code, mods;
+	if (kbd->macro_state.macro)
+		kbd->macro_state.repeat_timeout = timeout;
+	else
+		timer_add(kbd, kbd->now + timeout, TIMER_MACRO_REPEAT, 0);
+}
 
-		case MACRO_HOLD:
-			if (hold_start == -1)
-				hold_start = i;
+static void free_retired(struct keyboard *kbd)
+{
+	while (kbd->overlay.retired) {
+		struct overlay_storage *storage = kbd->overlay.retired;
 
-			kbd_send_key(kbd, ent->data, 1);
+		kbd->overlay.retired = storage->next;
 
-			break;
-		case MACRO_RELEASE:
-			if (hold_start != -1) {
-				size_t j;
+		layer_table_release_extension(&storage->lt);
+		free(storage);
+	}
+}
 
-				for (j = hold_start; j < i; j++) {
-					const struct macro_entry *ent = &macro->entries[j];
-					kbd_send_key(kbd, ent->data, 0);
-				}
+static int quiescent(struct keyboard *kbd);
 
-				hold_start = -1;
-			}
-			break;
-		case MACRO_UNICODE:
-			n = ent->data;
+/*
+ * Free the storage of overwritten bindings once the keyboard is quiescent
+ * (at which point no copies of them can remain in use).
+ */
+static void reclaim_storage(struct keyboard *kbd)
+{
+	if (!kbd->overlay.retired || !quiescent(kbd))
+		return;
 
-			kbd_send_key(kbd, KEYD_LINEFEED, 1);
-			kbd_send_key(kbd, KEYD_LINEFEED, 0);
+	free_retired(kbd);
+	kbd->active_macro = NULL;
+}
 
-			for (j = 10000; j; j /= 10) {
-				int digit = n / j;
-				code = digit == 0 ? KEYD_0 : digit - 1 + KEYD_1;
+static void storage_put(struct keyboard *kbd, struct overlay_storage *storage)
+{
+	if (--storage->refs)
+		return;
 
-				kbd_send_key(kbd, code, 1);
-				kbd_send_key(kbd, code, 0);
-				n %= j;
-			}
-			break;
-		case MACRO_KEYSEQUENCE:
-			code = ent->data;
-			mods = ent->data >> 8;
+	storage->next = kbd->overlay.retired;
+	kbd->overlay.retired = storage;
+}
 
-			if (kbd->keystate[code])
-				kbd_send_key(kbd, code, 0);
+static int overlay_set(struct keyboard *kbd, int layer, uint8_t code,
+		       const struct descriptor *d, struct overlay_storage *storage)
+{
+	size_t i;
+	struct overlay_entry *ent;
 
-			send_mods(kbd, mods, 1);
-			kbd_send_key(kbd, code, 1);
-			kbd_send_key(kbd, code, 0);
-			send_mods(kbd, mods, 0);
+	for (i = 0; i < kbd->overlay.nr; i++) {
+		ent = &kbd->overlay.entries[i];
 
-			break;
-		case MACRO_TIMEOUT:
-			usleep(ent->data*1E3);
-			break;
+		if (ent->layer == layer && ent->code == code) {
+			storage->refs++;
+			storage_put(kbd, ent->storage);
+
+			ent->d = *d;
+			ent->storage = storage;
+			return 0;
 		}
+	}
+
+	if (kbd->overlay.nr == MAX_OVERLAY_ENTRIES) {
+		err("max runtime bindings (%d) exceeded", MAX_OVERLAY_ENTRIES);
+		return -1;
+	}
+
+	ent = &kbd->overlay.entries[kbd->overlay.nr++];
+
+	ent->layer = layer;
+	ent->code = code;
+	ent->d = *d;
+	ent->storage = storage;
+	storage->refs++;
+
+	keyset_add(&kbd->overlay.codes, code);
+
+	return 0;
+}
+
+/*
+ * Returns the binding for the given key, taking runtime bindings into
+ * account, and stores the table which contains its storage in *lt.
+ */
+static const struct descriptor *get_binding(struct keyboard *kbd, int layer, uint8_t code,
+					    const struct layer_table **lt)
+{
+	size_t i;
+
+	if (keyset_has(&kbd->overlay.codes, code)) {
+		for (i = 0; i < kbd->overlay.nr; i++) {
+			const struct overlay_entry *ent = &kbd->overlay.entries[i];
 
+			if (ent->layer == layer && ent->code == code) {
+				*lt = &ent->storage->lt;
+				return &ent->d;
+			}
+		}
 	}
 
-	send_mods(kbd, disable_mods, 1);
+	*lt = &kbd->config->layer_table;
+	return layer_table_get(&kbd->config->layer_table,
+			       &kbd->config->layer_table.layers[layer],
+			       code);
 }
 
 int kbd_execute_expression(struct keyboard *kbd, const char *exp)
 {
-	return layer_table_add_entry(&kbd->layer_table, exp);
+	int ret = 0;
+	struct binding b;
+	struct overlay_storage *storage;
+
+	if (!(storage = calloc(1, sizeof *storage))) {
+		err("out of memory");
+		return -1;
+	}
+
+	/* The config is left untouched, only its layers are consulted. */
+	layer_table_extend(&storage->lt, &kbd->config->layer_table);
+	storage->refs = 1;
+
+	if (layer_table_parse_binding(&storage->lt, exp, &b) < 0 ||
+	    (b.code1 && overlay_set(kbd, b.layer, b.code1, &b.d, storage) < 0) ||
+	    (b.code2 && overlay_set(kbd, b.layer, b.code2, &b.d, storage) < 0))
+		ret = -1;
+
+	storage_put(kbd, storage);
+	reclaim_storage(kbd);
+
+	return ret;
 }
 
-void kbd_reset(struct keyboard *kbd)
+/* Drop all runtime bindings, their storage is reclaimed once it is unused. */
+static void overlay_clear(struct keyboard *kbd)
 {
-	uint8_t flags[MAX_LAYERS];
-	long at[MAX_LAYERS];
 	size_t i;
 
-	/* Preserve layer state to facilitate hotswapping (TODO: make this more robust) */
+	for (i = 0; i < kbd->overlay.nr; i++)
+		storage_put(kbd, kbd->overlay.entries[i].storage);
 
-	for (i = 0; i < kbd->config.layer_table.nr; i++) {
-		flags[i] = kbd->layer_table.layers[i].flags;
-		at[i] = kbd->layer_table.layers[i].activation_time;
-	}
+	memset(&kbd->overlay.codes, 0, sizeof(kbd->overlay.codes));
+	kbd->overlay.nr = 0;
+}
 
-	memcpy(&kbd->layer_table,
-		&kbd->config.layer_table,
-		sizeof(kbd->layer_table));
+static void update_leds(struct keyboard *kbd);
 
-	for (i = 0; i < kbd->config.layer_table.nr; i++) {
-		kbd->layer_table.layers[i].flags = flags[i];
-		kbd->layer_table.layers[i].activation_time = at[i];
-	}
+/*
+ * Prepare a keyboard whose config and device have been populated for use.
+ * The main layer is always active.
+ */
+void kbd_init(struct keyboard *kbd)
+{
+	memset(&kbd->overlay, 0, sizeof kbd->overlay);
 
+	kbd->state.layers[0].flags = LF_ACTIVE;
+	kbd->state.active_layers[0] = 0;
+	kbd->state.nr_active_layers = 1;
+
+	kbd->leds_unknown = 1;
+	update_leds(kbd);
 }
 
-static void lookup_descriptor(struct keyboard *kbd, uint8_t code, uint8_t *layer_mods, struct descriptor *d)
+/* Release the configs and runtime bindings held by the keyboard. */
+void kbd_free(struct keyboard *kbd)
+{
+	overlay_clear(kbd);
+	free_retired(kbd);
+
+	config_release(kbd->config);
+	if (kbd->pending_config)
+		config_release(kbd->pending_config);
+
+	kbd->config = NULL;
+	kbd->pending_config = NULL;
+}
+
+void kbd_save_state(const struct keyboard *kbd, struct kbd_state *state)
+{
+	*state = kbd->state;
+}
+
+/*
+ * Restore previously saved state. Keys are struck or released as necessary
+ * to bring the virtual keyboard in line with the restored key state. Layer
+ * state is restored by index, so the layout of the layer table should
+ * match the one from which the snapshot was taken.
+ */
+void kbd_restore_state(struct keyboard *kbd, const struct kbd_state *state)
 {
-	size_t max;
 	size_t i;
-	uint8_t active[MAX_LAYERS];
-	struct layer_table *lt = &kbd->layer_table;
+
+	for (i = 0; i < 256; i++)
+		if (kbd->state.keystate[i] != state->keystate[i])
+			kbd_send_key(kbd, i, state->keystate[i]);
+
+	flush_output(kbd);
+
+	kbd->state = *state;
+}
+
+/*
+ * Drop any dynamically applied bindings (and reclaim their storage). Layer
+ * state is preserved.
+ */
+void kbd_reset(struct keyboard *kbd)
+{
+	struct kbd_state state;
+
+	kbd_save_state(kbd, &state);
+
+	overlay_clear(kbd);
+	reclaim_storage(kbd);
+
+	kbd_restore_state(kbd, &state);
+}
+
+/*
+ * Find the descriptor for the given key in the active layers and store the
+ * table which contains its storage in *dlt.
+ */
+static void lookup_descriptor(struct keyboard *kbd, uint8_t code, uint8_t *layer_mods,
+			      struct descriptor *d, const struct layer_table **dlt)
+{
+	size_t max;
+	size_t i, j;
+	struct config *config = kbd->config;
+	struct layer_table *lt = &config->layer_table;
+	struct kbd_state *st = &kbd->state;
+	PROFILE_START(start);
+
 	d->op = OP_UNDEFINED;
+	d->prog = 0;
+	*dlt = lt;
 
 	*layer_mods = 0;
-	long maxts = 0;
 
-	for (i = 0; i < lt->nr; i++) {
-		struct layer *layer = &lt->layers[i];
+	/* Consult active layers from the most recently activated down. */
+	for (i = st->nr_active_layers; i-- > 0;) {
+		int idx = st->active_layers[i];
+		const struct layer_table *llt;
+		const struct descriptor *ld;
 
-		if (layer->flags) {
-			active[i] = 1;
-			if (layer->keymap[code].op && layer->activation_time >= maxts) {
-				maxts = layer->activation_time;
-				*layer_mods = layer->mods;
-				*d = layer->keymap[code];
-			}
-		} else {
-			active[i] = 0;
+		if (!st->layers[idx].flags)
+			continue;
+
+		ld = get_binding(kbd, idx, code, &llt);
+
+		if (ld->op) {
+			*layer_mods = lt->layers[idx].mods;
+			*d = *ld;
+			*dlt = llt;
+			break;
 		}
 	}
 
 	max = 0;
-	/* Scan for any composite matches (which take precedence). */
-	for (i = 0; i < lt->nr; i++) {
-		struct layer *layer = &lt->layers[i];
-
-		if (layer->type == LT_COMPOSITE) {
-			size_t j;
-			int match = 1;
-			uint8_t mods = 0;
-
-			for (j = 0; j < layer->nr_layers; j++) {
-				if (active[layer->layers[j]])
-					mods |= lt->layers[layer->layers[j]].mods;
-				else
-					match = 0;
-			}
+	/* Composite layers whose constituents are all active take precedence. */
+	for (i = 0; i < config->nr_composites; i++) {
+		int idx = config->composites[i];
+		struct layer *layer = &lt->layers[idx];
+		const struct layer_table *llt;
+		const struct descriptor *ld;
+		uint8_t mods = 0;
+
+		if (layer->nr_layers <= max)
+			continue;
+
+		for (j = 0; j < layer->nr_layers; j++) {
+			if (!st->layers[layer->layers[j]].flags)
+				break;
+
+			mods |= lt->layers[layer->layers[j]].mods;
+		}
 
-			if (match && layer->keymap[code].op && (layer->nr_layers > max)) {
-				*layer_mods = mods;
-				*d = layer->keymap[code];
+		if (j < layer->nr_layers)
+			continue;
 
-				max = layer->nr_layers;
-			}
-		}
+		ld = get_binding(kbd, idx, code, &llt);
+
+		if (!ld->op)
+			continue;
+
+		*layer_mods = mods;
+		*d = *ld;
+		*dlt = llt;
+
+		max = layer->nr_layers;
 	}
+
+	PROFILE_END(PROFILE_LOOKUP, start);
 }
 
-static int cache_set(struct keyboard *kbd, uint8_t code, const struct descriptor *d, uint8_t mods)
+static int cache_set(struct keyboard *kbd, uint8_t code, const struct descriptor *d,
+		     const struct layer_table *lt, uint8_t mods)
 {
 	size_t i;
 	int slot = -1;
@@ -292,13 +642,15 @@ static int cache_set(struct keyboard *kbd, uint8_t code, const struct descriptor
 	} else {
 		kbd->cache[slot].code = code;
 		kbd->cache[slot].d = *d;
+		kbd->cache[slot].lt = lt;
 		kbd->cache[slot].layermods = mods;
 	}
 
 	return 0;
 }
 
-static int cache_get(struct keyboard *kbd, uint8_t code, struct descriptor *d, uint8_t *mods)
+static int cache_get(struct keyboard *kbd, uint8_t code, struct descriptor *d,
+		     const struct layer_table **lt, uint8_t *mods)
 {
 	size_t i;
 
@@ -306,6 +658,8 @@ static int cache_get(struct keyboard *kbd, uint8_t code, struct descriptor *d, u
 		if (kbd->cache[i].code == code) {
 			if (d)
 				*d = kbd->cache[i].d;
+			if (lt)
+				*lt = kbd->cache[i].lt;
 			if (mods)
 				*mods = kbd->cache[i].layermods;
 
@@ -315,16 +669,45 @@ static int cache_get(struct keyboard *kbd, uint8_t code, struct descriptor *d, u
 	return -1;
 }
 
+static struct layer_state *get_layer_state(struct keyboard *kbd, const struct layer *layer)
+{
+	return &kbd->state.layers[layer - kbd->config->layer_table.layers];
+}
+
+/*
+ * Move the given layer to the top of the activation stack. Layers which
+ * have since become inactive are pruned in the process, so each layer
+ * appears at most once.
+ */
+static void push_layer(struct keyboard *kbd, int idx)
+{
+	size_t i;
+	size_t n = 0;
+	struct kbd_state *st = &kbd->state;
+
+	for (i = 0; i < st->nr_active_layers; i++) {
+		uint8_t l = st->active_layers[i];
+
+		if (l != idx && st->layers[l].flags)
+			st->active_layers[n++] = l;
+	}
+
+	st->active_layers[n++] = idx;
+	st->nr_active_layers = n;
+}
+
 static void activate_layer(struct keyboard *kbd, struct layer *layer)
 {
-	layer->flags |= LF_ACTIVE;
+	struct layer_state *ls = get_layer_state(kbd, layer);
+
+	ls->flags |= LF_ACTIVE;
 	send_mods(kbd, layer->mods, 1);
-	layer->activation_time = get_time();
+	push_layer(kbd, ls - kbd->state.layers);
 }
 
 static void deactivate_layer(struct keyboard *kbd, struct layer *layer, int disarm_p)
 {
-	layer->flags &= ~LF_ACTIVE;
+	get_layer_state(kbd, layer)->flags &= ~LF_ACTIVE;
 
 	if (disarm_p)
 		disarm_mods(kbd, layer->mods);
@@ -332,211 +715,922 @@ static void deactivate_layer(struct keyboard *kbd, struct layer *layer, int disa
 		send_mods(kbd, layer->mods, 0);
 }
 
+static void resolve_pending_timeout(struct keyboard *kbd, size_t n, int expired);
+static void resolve_chord(struct keyboard *kbd, const struct key_event *ev);
+static void expire_leader(struct keyboard *kbd);
+
+/*
+ * Only LEDs whose state has changed are written to the device, so LEDs
+ * which are not used as indicators are left alone. If the device's state
+ * is unknown, every LED managed by the config is written.
+ */
 static void update_leds(struct keyboard *kbd)
 {
-	struct layer_table *lt = &kbd->layer_table;
+	size_t i;
+	uint8_t leds = 0;
+	uint8_t managed = 0;
+	uint8_t changed;
+	struct layer_table *lt = &kbd->config->layer_table;
 
-	if (!kbd->config.layer_indicator)
-		return;
+	if (kbd->config->layer_indicator) {
+		managed |= 1 << LED_CAPSLOCK;
 
-	size_t i;
-	int active = 0;
+		for (i = 0; i < lt->nr; i++) {
+			if (kbd->state.layers[i].flags && lt->layers[i].mods)
+				leds |= 1 << LED_CAPSLOCK;
+		}
+	}
+
+	for (i = 0; i < MAX_INDICATORS; i++) {
+		int idx = kbd->config->indicators[i];
 
-	for (i = 0; i < lt->nr; i++) {
-		if (lt->layers[i].flags && lt->layers[i].mods)
-			active = 1;
+		if (idx != -1) {
+			managed |= 1 << i;
+
+			if (kbd->state.layers[idx].flags)
+				leds |= 1 << i;
+		}
 	}
 
-	if (active) {
-		device_set_led(kbd->dev, 1, 1);
-	} else {
-		device_set_led(kbd->dev, 1, 0);
+	changed = leds ^ kbd->leds;
+
+	if (kbd->leds_unknown) {
+		changed |= managed;
+		kbd->leds_unknown = 0;
 	}
+
+	for (i = 0; i < MAX_INDICATORS; i++)
+		if (changed & (1 << i))
+			device_set_led(kbd->dev, i, (leds >> i) & 1);
+
+	kbd->leds = leds;
 }
 
-static long process_descriptor(struct keyboard *kbd, uint8_t code, struct descriptor *d, int descriptor_layer_mods, int pressed)
+/*
+ * Run the compiled program of the given descriptor (see enum instruction).
+ * Its program, macros and timeouts reside in `lt`, which is either the
+ * config's layer table or the storage of a runtime binding.
+ */
+static void process_descriptor(struct keyboard *kbd, uint8_t code, struct descriptor *d,
+			       const struct layer_table *lt, int descriptor_layer_mods, int pressed)
 {
-	int timeout = 0;
 	uint8_t clear_oneshot = 0;
 
-	struct macro *macros = kbd->layer_table.macros;
-	struct timeout *timeouts = kbd->layer_table.timeouts;
-	struct layer *layers = kbd->layer_table.layers;
-	size_t nr_layers = kbd->layer_table.nr;
+	const struct macro *macros = lt->macros;
+	const struct timeout *timeouts = lt->timeouts;
+	struct layer *layers = kbd->config->layer_table.layers;
+	size_t nr_layers = kbd->config->layer_table.nr;
 
-	switch (d->op) {
-		struct macro *macro;
-		struct layer *layer;
+	const uint8_t *pc = &lt->bytecode[d->prog];
 
-	case OP_MACRO:
-		macro = &macros[d->args[0].idx];
+	PROFILE_START(start);
 
-		if (pressed) {
-			execute_macro(kbd, macro, descriptor_layer_mods);
+	while (1) {
+		struct layer *layer;
+		struct layer_state *ls;
+		uint16_t idx;
+
+		switch (*pc++) {
+		case I_END:
+			goto done;
+		case I_JMP_RELEASED:
+			pc += pressed ? 1 : 1 + *pc;
+			break;
+		case I_JMP_TAP:
+			pc += kbd->last_pressed_keycode == code ? 1 + *pc : 1;
+			break;
+		case I_LAYER_ON:
+			activate_layer(kbd, &layers[*pc++]);
+			kbd->last_layer_code = code;
+			break;
+		case I_LAYER_OFF:
+			deactivate_layer(kbd, &layers[*pc++], 0);
+			break;
+		case I_LAYER_OFF_DISARM:
+			deactivate_layer(kbd, &layers[*pc++], 1);
+			break;
+		case I_KEY_DOWN:
+			disarm_mods(kbd, descriptor_layer_mods);
+			kbd_send_key(kbd, *pc++, 1);
+			break;
+		case I_KEY_UP:
+			kbd_send_key(kbd, *pc++, 0);
+			send_mods(kbd, descriptor_layer_mods, 1);
+			break;
+		case I_MACRO:
+			idx = pc[0] | pc[1] << 8;
+			pc += 2;
 
-			active_macro = macro;
-			active_macro_mods = descriptor_layer_mods;
+			execute_macro(kbd, lt, &macros[idx], descriptor_layer_mods);
+			break;
+		case I_REPEAT:
+			idx = pc[0] | pc[1] << 8;
+			pc += 2;
 
-			timeout = kbd->config.macro_timeout;
-		}
+			kbd->active_macro = &macros[idx];
+			kbd->active_macro_lt = lt;
+			kbd->active_macro_mods = descriptor_layer_mods;
 
-		oneshot_latch = 0;
-		clear_oneshot = 1;
-		break;
-	case OP_ONESHOT:
-		layer = &layers[d->args[0].idx];
+			schedule_repeat(kbd, kbd->config->macro_timeout);
+			break;
+		case I_ONESHOT_DOWN:
+			layer = &layers[*pc];
+			ls = &kbd->state.layers[*pc++];
 
-		if (pressed) {
-			if (layer->flags & LF_ONESHOT_HELD) {
+			if (ls->flags & LF_ONESHOT_HELD) {
 				/* Neutralize key up */
-				cache_set(kbd, code, NULL, 0);
+				cache_set(kbd, code, NULL, NULL, 0);
 			} else {
-				if (layer->flags & LF_ONESHOT) {
+				if (ls->flags & LF_ONESHOT) {
 					disarm_mods(kbd, layer->mods);
-					layer->flags &= ~LF_ONESHOT;
-				} 
+					ls->flags &= ~LF_ONESHOT;
+				}
 
 				send_mods(kbd, layer->mods, 1);
 
-				oneshot_latch = 1;
-				layer->flags |= LF_ONESHOT_HELD;
-				layer->activation_time = get_time();
+				kbd->state.oneshot_latch = 1;
+				ls->flags |= LF_ONESHOT_HELD;
+				push_layer(kbd, ls - kbd->state.layers);
 			}
-		} else if (oneshot_latch) {
-			if (layer->flags & LF_ONESHOT) {
-				/* 
-				 * If oneshot is already set for the layer we can't
-				 * rely on the clear logic to mirror our send_mod()
-				 * call.
-				 */
-				disarm_mods(kbd, layer->mods);
+			break;
+		case I_ONESHOT_UP:
+			layer = &layers[*pc];
+			ls = &kbd->state.layers[*pc++];
+
+			if (kbd->state.oneshot_latch) {
+				if (ls->flags & LF_ONESHOT) {
+					/*
+					 * If oneshot is already set for the layer we can't
+					 * rely on the clear logic to mirror our send_mod()
+					 * call.
+					 */
+					disarm_mods(kbd, layer->mods);
+				} else {
+					ls->flags |= LF_ONESHOT;
+					ls->flags &= ~LF_ONESHOT_HELD;
+				}
 			} else {
-				layer->flags |= LF_ONESHOT;
-				layer->flags &= ~LF_ONESHOT_HELD;
-			}
-		} else {
-			send_mods(kbd, layer->mods, 0);
-
-			layer->flags &= ~LF_ONESHOT_HELD;
-		}
+				send_mods(kbd, layer->mods, 0);
 
-		break;
-	case OP_TOGGLE:
-		layer = &layers[d->args[0].idx];
+				ls->flags &= ~LF_ONESHOT_HELD;
+			}
+			break;
+		case I_TOGGLE:
+			layer = &layers[*pc];
+			ls = &kbd->state.layers[*pc++];
 
-		if (!pressed) {
-			layer->flags ^= LF_TOGGLE;
+			ls->flags ^= LF_TOGGLE;
 
-			if (layer->flags & LF_TOGGLE)
+			if (ls->flags & LF_TOGGLE)
 				activate_layer(kbd, layer);
 			else
 				deactivate_layer(kbd, layer, 0);
-		}
+			break;
+		case I_SWAP: {
+			struct descriptor od;
 
-		clear_oneshot = 1;
-		break;
-	case OP_KEYCODE:
-		if (pressed) {
-			disarm_mods(kbd, descriptor_layer_mods);
-			kbd_send_key(kbd, d->args[0].code, 1);
-		} else {
-			kbd_send_key(kbd, d->args[0].code, 0);
-			send_mods(kbd, descriptor_layer_mods, 1);
-			clear_oneshot = 1;
-		}
-
-		oneshot_latch = 0;
-		break;
-	case OP_LAYER:
-		layer = &layers[d->args[0].idx];
-
-		if (pressed) {
-			activate_layer(kbd, layer);
-			kbd->last_layer_code = code;
-		} else {
-			deactivate_layer(kbd, layer, kbd->last_pressed_keycode != code);
-		}
-		break;
-	case OP_SWAP:
-		layer = &layers[d->args[0].idx];
-		macro = d->args[1].idx == -1 ? NULL : &macros[d->args[1].idx];
+			layer = &layers[pc[0]];
+			idx = pc[1] | pc[2] << 8;
+			pc += 3;
 
-		if (pressed) {
-			struct descriptor od;
-
-			if (!cache_get(kbd, kbd->last_layer_code, &od, NULL)) {
+			if (!cache_get(kbd, kbd->last_layer_code, &od, NULL, NULL)) {
 				struct layer *oldlayer = &layers[od.args[0].idx];
 
-				cache_set(kbd, kbd->last_layer_code, d, descriptor_layer_mods);
-				cache_set(kbd, code, NULL, 0);
+				cache_set(kbd, kbd->last_layer_code, d, lt, descriptor_layer_mods);
+				cache_set(kbd, code, NULL, NULL, 0);
 
 				activate_layer(kbd, layer);
 				deactivate_layer(kbd, oldlayer, 1);
 
-				if (macro)
-					execute_macro(kbd, macro, layer->mods);
+				if (idx != 0xffff)
+					execute_macro(kbd, lt, &macros[idx], layer->mods);
 			}
-		} else
-			deactivate_layer(kbd, layer, 1);
+			break;
+		}
+		case I_TIMEOUT: {
+			struct pending_timeout *pt;
 
-		break;
-	case OP_OVERLOAD:
-		layer = &layers[d->args[0].idx];
-		macro = &macros[d->args[1].idx];
+			idx = pc[0] | pc[1] << 8;
+			pc += 2;
 
-		if (pressed) {
-			activate_layer(kbd, layer);
-			kbd->last_layer_code = code;
-		} else {
-			deactivate_layer(kbd, layer, 1);
+			if (kbd->nr_pending_timeouts == MAX_PENDING_TIMEOUTS)
+				resolve_pending_timeout(kbd, 0, 0);
 
-			if (kbd->last_pressed_keycode == code) {
-				execute_macro(kbd, macro, descriptor_layer_mods);
+			pt = &kbd->pending_timeouts[kbd->nr_pending_timeouts++];
 
-				oneshot_latch = 0;
-				clear_oneshot = 1;
-			}
-		}
+			pt->t = timeouts[idx];
+			pt->lt = lt;
+			pt->code = code;
+			pt->mods = descriptor_layer_mods;
+			pt->timer = timer_add(kbd,
+					      kbd->now + pt->t.timeout,
+					      TIMER_TIMEOUT, code);
 
-		break;
-	case OP_TIMEOUT:
-		if (pressed) {
-			kbd->pending_timeout.t = timeouts[d->args[0].idx];
-			kbd->pending_timeout.code = code;
-			kbd->pending_timeout.mods = descriptor_layer_mods;
-
-			timeout = kbd->pending_timeout.t.timeout;
+			/* No free timers, treat it as interrupted. */
+			if (pt->timer < 0)
+				resolve_pending_timeout(kbd, kbd->nr_pending_timeouts - 1, 0);
+			break;
 		}
-		break;
-	case OP_UNDEFINED:
-		if (pressed)
+		case I_LEADER:
+			if (kbd->config->layer_table.nr_leader_nodes) {
+				kbd->leader_state.active = 1;
+				kbd->leader_state.node = 0;
+				kbd->leader_state.n = 0;
+				kbd->leader_state.timer = timer_add(kbd,
+								    kbd->now + kbd->config->leader_timeout,
+								    TIMER_LEADER, 0);
+			}
+			break;
+		case I_LOOKAHEAD:
+			if (kbd->overload_state.active)
+				timer_cancel(kbd, kbd->overload_state.timer);
+
+			kbd->overload_state.active = 1;
+			kbd->overload_state.code = code;
+			kbd->overload_state.timer = timer_add(kbd,
+							      kbd->now + kbd->config->lookahead_timeout,
+							      TIMER_OVERLOAD, code);
+			break;
+		case I_CLEAR_ONESHOT:
 			clear_oneshot = 1;
-		break;
+			break;
+		case I_RESET_LATCH:
+			kbd->state.oneshot_latch = 0;
+			break;
+		}
 	}
 
+done:
 	if (clear_oneshot) {
 		size_t i = 0;
 
 		for (i = 0; i < nr_layers; i++) {
 			struct layer *layer = &layers[i];
+			struct layer_state *ls = &kbd->state.layers[i];
 
-			if (layer->flags & LF_ONESHOT) {
-				layer->flags &= ~LF_ONESHOT;
+			if (ls->flags & LF_ONESHOT) {
+				ls->flags &= ~LF_ONESHOT;
 
 				send_mods(kbd, layer->mods, 0);
 			}
 		}
 
-		oneshot_latch = 0;
+		kbd->state.oneshot_latch = 0;
 	}
 
 	if (pressed)
 		kbd->last_pressed_keycode = code;
 
 	update_leds(kbd);
-	return timeout;
+
+	PROFILE_END(d->op, start);
+}
+
+/*
+ * Resolve the nth pending timeout with its first (or second if `expired`
+ * is set) action.
+ */
+static void resolve_pending_timeout(struct keyboard *kbd, size_t n, int expired)
+{
+	struct pending_timeout pt = kbd->pending_timeouts[n];
+	struct descriptor *d = expired ? &pt.t.d2 : &pt.t.d1;
+
+	timer_cancel(kbd, pt.timer);
+
+	memmove(&kbd->pending_timeouts[n],
+		&kbd->pending_timeouts[n+1],
+		(kbd->nr_pending_timeouts-n-1) * sizeof(kbd->pending_timeouts[0]));
+	kbd->nr_pending_timeouts--;
+
+	cache_set(kbd, pt.code, d, pt.lt, pt.mods);
+	process_descriptor(kbd, pt.code, d, pt.lt, pt.mods, 1);
+}
+
+
+static void fire_timer(struct keyboard *kbd, const struct timer *t)
+{
+	size_t i;
+
+	switch (t->type) {
+	case TIMER_MACRO:
+		macro_step(kbd);
+		break;
+	case TIMER_MACRO_REPEAT:
+		if (kbd->active_macro) {
+			execute_macro(kbd, kbd->active_macro_lt,
+				      kbd->active_macro, kbd->active_macro_mods);
+			schedule_repeat(kbd, kbd->config->macro_repeat_timeout);
+		}
+		break;
+	case TIMER_TIMEOUT:
+		for (i = 0; i < kbd->nr_pending_timeouts; i++) {
+			if (kbd->pending_timeouts[i].code == t->code) {
+				resolve_pending_timeout(kbd, i, 1);
+				break;
+			}
+		}
+		break;
+	case TIMER_CHORD:
+		if (kbd->chord_state.n)
+			resolve_chord(kbd, NULL);
+		break;
+	case TIMER_LEADER:
+		if (kbd->leader_state.active)
+			expire_leader(kbd);
+		break;
+	case TIMER_OVERLOAD:
+		kbd->overload_state.active = 0;
+		break;
+	}
+}
+
+/*
+ * Fire all timers which have expired by `now` in deadline order, including
+ * those which expire while a macro is suspended.
+ */
+static void process_timers(struct keyboard *kbd, long now)
+{
+	int i;
+
+	while ((i = timer_next(kbd)) != -1) {
+		struct timer t = kbd->timers[i];
+
+		if (t.deadline > now)
+			break;
+
+		/* Subsequent timers are relative to the expiry time. */
+		kbd->now = t.deadline;
+
+		timer_cancel(kbd, i);
+		fire_timer(kbd, &t);
+	}
+
+	kbd->now = now;
+}
+
+static void process_key(struct keyboard *kbd, uint8_t code, int pressed)
+{
+	uint8_t descriptor_layer_mods;
+	struct descriptor d;
+	const struct layer_table *lt;
+
+	if (kbd->active_macro) {
+		kbd->active_macro = NULL;
+		timer_cancel_type(kbd, TIMER_MACRO_REPEAT);
+	}
+
+	if (pressed) {
+		lookup_descriptor(kbd, code, &descriptor_layer_mods, &d, &lt);
+
+		if (cache_set(kbd, code, &d, lt, descriptor_layer_mods) < 0)
+			return;
+	} else {
+		if (cache_get(kbd, code, &d, &lt, &descriptor_layer_mods) < 0)
+			return;
+
+		cache_set(kbd, code, NULL, NULL, 0);
+	}
+
+	process_descriptor(kbd, code, &d, lt, descriptor_layer_mods, pressed);
+}
+
+/*
+ * Return the chord in an active layer whose keys are exactly `keys`, and set
+ * *partial if `keys` is a proper subset of some other active chord (i.e
+ * additional keys may yet complete it).
+ */
+static const struct chord *lookup_chord(struct keyboard *kbd, const struct keyset *keys, int *partial)
+{
+	size_t i;
+	int maxpos = -1;
+	int pos[MAX_LAYERS];
+	const struct chord *match = NULL;
+	struct layer_table *lt = &kbd->config->layer_table;
+	struct kbd_state *st = &kbd->state;
+
+	*partial = 0;
+
+	/* The position of each active layer in the activation stack. */
+	for (i = 0; i < lt->nr; i++)
+		pos[i] = -1;
+
+	for (i = 0; i < st->nr_active_layers; i++)
+		if (st->layers[st->active_layers[i]].flags)
+			pos[st->active_layers[i]] = i;
+
+	for (i = 0; i < lt->nr_chords; i++) {
+		const struct chord *chord = &lt->chords[i];
+
+		if (pos[chord->layer] == -1 || !keyset_subset(keys, &chord->keys))
+			continue;
+
+		if (!keyset_equal(keys, &chord->keys))
+			*partial = 1;
+		else if (pos[chord->layer] > maxpos) {
+			maxpos = pos[chord->layer];
+			match = chord;
+		}
+	}
+
+	return match;
+}
+
+/*
+ * Requeue the given events ahead of any which are already queued. If there
+ * is insufficient room they are processed immediately (without chord
+ * detection).
+ */
+static void requeue_events(struct keyboard *kbd, const struct key_event *events, size_t n)
+{
+	size_t i;
+
+	if (kbd->nr_queued + keyset_count(&kbd->held_keys) + n > MAX_QUEUED_EVENTS) {
+		for (i = 0; i < n; i++)
+			process_key(kbd, events[i].code, events[i].pressed);
+
+		return;
+	}
+
+	memmove(kbd->queue+n, kbd->queue, kbd->nr_queued * sizeof(kbd->queue[0]));
+	memcpy(kbd->queue, events, n * sizeof(kbd->queue[0]));
+	kbd->nr_queued += n;
+}
+
+static void activate_chord(struct keyboard *kbd, const struct chord *chord)
+{
+	size_t i;
+	struct active_chord *ac = NULL;
+
+	for (i = 0; i < MAX_ACTIVE_CHORDS; i++)
+		if (keyset_empty(&kbd->active_chords[i].keys))
+			ac = &kbd->active_chords[i];
+
+	/* Guaranteed by process_chord(). */
+	if (!ac)
+		return;
+
+	ac->keys = kbd->chord_state.keys;
+	ac->code = kbd->chord_state.events[0].code;
+	ac->mods = kbd->config->layer_table.layers[chord->layer].mods;
+	ac->d = chord->d;
+	ac->released = 0;
+
+	process_descriptor(kbd, ac->code, &ac->d, &kbd->config->layer_table, ac->mods, 1);
+}
+
+/*
+ * Resolve the pending chord (if any) by either activating the matching chord
+ * or replaying the buffered events. `ev` is an optional event which
+ * triggered resolution and is subsequently reprocessed.
+ */
+static void resolve_chord(struct keyboard *kbd, const struct key_event *ev)
+{
+	int partial;
+	struct key_event events[MAX_CHORD_KEYS+1];
+	size_t n = kbd->chord_state.n;
+	const struct chord *chord = lookup_chord(kbd, &kbd->chord_state.keys, &partial);
+
+	memcpy(events, kbd->chord_state.events, n * sizeof(events[0]));
+	if (ev)
+		events[n++] = *ev;
+
+	timer_cancel(kbd, kbd->chord_state.timer);
+
+	if (chord) {
+		activate_chord(kbd, chord);
+		kbd->chord_state.n = 0;
+
+		if (ev)
+			requeue_events(kbd, ev, 1);
+	} else {
+		/*
+		 * Miss: the first key is processed normally and the rest are
+		 * requeued since they may themselves begin a chord.
+		 */
+		kbd->chord_state.n = 0;
+
+		requeue_events(kbd, events+1, n-1);
+		process_key(kbd, events[0].code, events[0].pressed);
+	}
+}
+
+/* Returns 1 if the event was consumed by the chord engine. */
+static int process_chord(struct keyboard *kbd, uint8_t code, int pressed)
+{
+	size_t i;
+	int partial;
+	struct key_event ev = { code, pressed };
+
+	if (!pressed) {
+		for (i = 0; i < MAX_ACTIVE_CHORDS; i++) {
+			struct active_chord *ac = &kbd->active_chords[i];
+
+			if (keyset_has(&ac->keys, code)) {
+				/* The chord ends when any of its keys are released. */
+				if (!ac->released) {
+					process_descriptor(kbd, ac->code, &ac->d,
+							   &kbd->config->layer_table, ac->mods, 0);
+					ac->released = 1;
+				}
+
+				keyset_del(&ac->keys, code);
+				return 1;
+			}
+		}
+
+		if (kbd->chord_state.n) {
+			resolve_chord(kbd, &ev);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (!kbd->chord_state.n) {
+		struct keyset keys = {0};
+
+		if (!kbd->config->layer_table.nr_chords)
+			return 0;
+
+		for (i = 0; i < MAX_ACTIVE_CHORDS; i++)
+			if (keyset_empty(&kbd->active_chords[i].keys))
+				break;
+
+		if (i == MAX_ACTIVE_CHORDS)
+			return 0;
+
+		keyset_add(&keys, code);
+		lookup_chord(kbd, &keys, &partial);
+
+		if (!partial)
+			return 0;
+
+		kbd->chord_state.keys = keys;
+		kbd->chord_state.events[kbd->chord_state.n++] = ev;
+		kbd->chord_state.timer = timer_add(kbd,
+						   kbd->now + kbd->config->chord_timeout,
+						   TIMER_CHORD, 0);
+
+		return 1;
+	}
+
+	kbd->chord_state.events[kbd->chord_state.n++] = ev;
+	keyset_add(&kbd->chord_state.keys, code);
+
+	lookup_chord(kbd, &kbd->chord_state.keys, &partial);
+
+	if (!partial || kbd->chord_state.n == MAX_CHORD_KEYS)
+		resolve_chord(kbd, NULL);
+
+	return 1;
+}
+
+/*
+ * Abandon the current leader() sequence and process the consumed keys as
+ * though leader() had not been struck. Keys which are still held are left
+ * depressed.
+ */
+static void abort_leader(struct keyboard *kbd)
+{
+	size_t i, j;
+
+	kbd->leader_state.active = 0;
+	timer_cancel(kbd, kbd->leader_state.timer);
+
+	for (i = 0; i < kbd->leader_state.n; i++) {
+		uint8_t code = kbd->leader_state.keys[i];
+		int held = keyset_has(&kbd->leader_state.held, code);
+
+		for (j = i+1; held && j < kbd->leader_state.n; j++)
+			if (kbd->leader_state.keys[j] == code)
+				held = 0;
+
+		process_key(kbd, code, 1);
+
+		if (held)
+			keyset_del(&kbd->leader_state.held, code);
+		else
+			process_key(kbd, code, 0);
+	}
+}
+
+/*
+ * Invoked when no key has been struck for leader_timeout ms. A sequence
+ * which is a prefix of a longer one is performed, anything else is aborted.
+ */
+static void expire_leader(struct keyboard *kbd)
+{
+	struct leader_node *ln = &kbd->config->layer_table.leader_nodes[kbd->leader_state.node];
+
+	if (ln->d.op == OP_UNDEFINED) {
+		abort_leader(kbd);
+		return;
+	}
+
+	kbd->leader_state.active = 0;
+
+	process_descriptor(kbd, ln->code, &ln->d, &kbd->config->layer_table, 0, 1);
+	process_descriptor(kbd, ln->code, &ln->d, &kbd->config->layer_table, 0, 0);
+}
+
+/* Returns 1 if the event was consumed by a leader() sequence. */
+static int process_leader(struct keyboard *kbd, uint8_t code, int pressed)
+{
+	uint16_t child;
+	struct layer_table *lt = &kbd->config->layer_table;
+	struct leader_node *nodes = lt->leader_nodes;
+
+	if (!pressed) {
+		if (keyset_has(&kbd->leader_state.held, code)) {
+			keyset_del(&kbd->leader_state.held, code);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (!kbd->leader_state.active)
+		return 0;
+
+	if (kbd->leader_state.n < MAX_LEADER_KEYS)
+		kbd->leader_state.keys[kbd->leader_state.n++] = code;
+
+	keyset_add(&kbd->leader_state.held, code);
+
+	for (child = nodes[kbd->leader_state.node].child; child; child = nodes[child].next)
+		if (nodes[child].code == code)
+			break;
+
+	if (!child) {
+		abort_leader(kbd);
+		return 1;
+	}
+
+	kbd->leader_state.node = child;
+
+	if (!nodes[child].child) {
+		/*
+		 * The sequence is complete, bind the descriptor to the final
+		 * key so that it is released along with it.
+		 */
+		kbd->leader_state.active = 0;
+		timer_cancel(kbd, kbd->leader_state.timer);
+		keyset_del(&kbd->leader_state.held, code);
+
+		if (cache_set(kbd, code, &nodes[child].d, lt, 0) < 0)
+			return 1;
+
+		process_descriptor(kbd, code, &nodes[child].d, lt, 0, 1);
+		return 1;
+	}
+
+	timer_cancel(kbd, kbd->leader_state.timer);
+	kbd->leader_state.timer = timer_add(kbd,
+					    kbd->now + kbd->config->leader_timeout,
+					    TIMER_LEADER, 0);
+	return 1;
+}
+
+static void process_event(struct keyboard *kbd, uint8_t code, int pressed)
+{
+	if (process_leader(kbd, code, pressed))
+		return;
+
+	if (!process_chord(kbd, code, pressed))
+		process_key(kbd, code, pressed);
+}
+
+/*
+ * Attempt to resolve a pending overload() by looking ahead in the queue.
+ * The key is considered held if another key is both struck and released
+ * before it is released, and tapped if it is released first. In the latter
+ * case the release is moved to the front of the queue so that the tap
+ * precedes any intervening keys. It is also considered held once the queue
+ * has no room for another key.
+ *
+ * Returns 0 if the queue does not yet contain enough information.
+ */
+static int resolve_overload(struct keyboard *kbd)
+{
+	size_t i;
+	struct keyset pressed = {0};
+
+	for (i = 0; i < kbd->nr_queued; i++) {
+		struct key_event ev = kbd->queue[i];
+
+		if (ev.pressed) {
+			keyset_add(&pressed, ev.code);
+		} else if (ev.code == kbd->overload_state.code) {
+			memmove(kbd->queue+1, kbd->queue, i * sizeof(kbd->queue[0]));
+			kbd->queue[0] = ev;
+			goto resolved;
+		} else if (keyset_has(&pressed, ev.code)) {
+			goto resolved;
+		}
+	}
+
+	if (kbd->nr_queued + keyset_count(&kbd->held_keys) + 2 <= MAX_QUEUED_EVENTS)
+		return 0;
+
+resolved:
+	kbd->overload_state.active = 0;
+	timer_cancel(kbd, kbd->overload_state.timer);
+
+	return 1;
+}
+
+/*
+ * Process queued events in order until either the queue is exhausted, a
+ * macro is suspended or a pending overload() cannot yet be resolved.
+ */
+static void drain_queue(struct keyboard *kbd)
+{
+	while (kbd->nr_queued && !kbd->macro_state.macro) {
+		struct key_event ev = kbd->queue[0];
+
+		/*
+		 * Releases of keys struck before a pending overload() do
+		 * not bear on its resolution and can be processed eagerly.
+		 */
+		if (kbd->overload_state.active &&
+		    (ev.pressed || ev.code == kbd->overload_state.code) &&
+		    !resolve_overload(kbd))
+			break;
+
+		ev = kbd->queue[0];
+
+		/*
+		 * Any event other than the depression of another timeout()
+		 * key resolves pending timeouts in favour of their first
+		 * action.
+		 */
+		if (kbd->nr_pending_timeouts) {
+			uint8_t mods;
+			const struct layer_table *lt;
+			struct descriptor d = { .op = OP_UNDEFINED };
+
+			if (ev.pressed)
+				lookup_descriptor(kbd, ev.code, &mods, &d, &lt);
+
+			if (!ev.pressed || d.op != OP_TIMEOUT) {
+				resolve_pending_timeout(kbd, 0, 0);
+				continue;
+			}
+		}
+
+		kbd->nr_queued--;
+		memmove(kbd->queue, kbd->queue+1, kbd->nr_queued * sizeof(kbd->queue[0]));
+
+		process_event(kbd, ev.code, ev.pressed);
+	}
+}
+
+/*
+ * Queue an incoming event. Events which arrive while a macro is suspended
+ * remain queued until it has completed.
+ *
+ * Room is reserved in the queue for the release of every held key, so a key
+ * struck while the queue is full is dropped (along with its release) rather
+ * than cutting a suspended macro short.
+ */
+static void queue_event(struct keyboard *kbd, uint8_t code, int pressed)
+{
+	size_t needed;
+	int held = keyset_has(&kbd->held_keys, code);
+
+	if (!pressed && keyset_has(&kbd->dropped_keys, code)) {
+		keyset_del(&kbd->dropped_keys, code);
+		return;
+	}
+
+	/* The release of a held key occupies the room reserved for it. */
+	if (held)
+		needed = pressed ? 1 : 0;
+	else
+		needed = pressed ? 2 : 1;
+
+	if (kbd->nr_queued + keyset_count(&kbd->held_keys) + needed > MAX_QUEUED_EVENTS) {
+		if (pressed && !held)
+			keyset_add(&kbd->dropped_keys, code);
+
+		return;
+	}
+
+	if (pressed)
+		keyset_add(&kbd->held_keys, code);
+	else
+		keyset_del(&kbd->held_keys, code);
+
+	kbd->queue[kbd->nr_queued].code = code;
+	kbd->queue[kbd->nr_queued].pressed = pressed;
+	kbd->nr_queued++;
+}
+
+/* Returns 1 if no keys are held and no actions are in progress. */
+static int quiescent(struct keyboard *kbd)
+{
+	size_t i;
+
+	for (i = 0; i < CACHE_SIZE; i++)
+		if (kbd->cache[i].code)
+			return 0;
+
+	for (i = 0; i < MAX_ACTIVE_CHORDS; i++)
+		if (!keyset_empty(&kbd->active_chords[i].keys))
+			return 0;
+
+	return !kbd->nr_queued &&
+		!kbd->active_timers &&
+		!kbd->macro_state.macro &&
+		!kbd->nr_pending_timeouts &&
+		!kbd->chord_state.n &&
+		!kbd->leader_state.active &&
+		!kbd->overload_state.active;
+}
+
+/*
+ * The number of times a layer's modifiers are held on account of its state
+ * while the keyboard is quiescent (i.e by toggle() and oneshot()).
+ */
+static int layer_mod_refs(uint8_t flags)
+{
+	return !!(flags & LF_TOGGLE) + !!(flags & LF_ONESHOT);
+}
+
+/*
+ * Swap in the pending config if the keyboard is quiescent. Layer state is
+ * carried over by name (layers which no longer exist are deactivated) and
+ * runtime bindings are dropped.
+ */
+static void try_reload(struct keyboard *kbd)
+{
+	size_t i;
+	int n;
+	struct kbd_state state;
+	struct layer_table *olt = &kbd->config->layer_table;
+	struct layer_table *nlt;
+	int map[MAX_LAYERS];
+
+	if (!kbd->pending_config || !quiescent(kbd))
+		return;
+
+	nlt = &kbd->pending_config->layer_table;
+
+	for (i = 0; i < olt->nr; i++)
+		for (n = layer_mod_refs(kbd->state.layers[i].flags); n > 0; n--)
+			send_mods(kbd, olt->layers[i].mods, 0);
+
+	kbd_save_state(kbd, &state);
+	memset(state.layers, 0, sizeof state.layers);
+
+	for (i = 0; i < olt->nr; i++) {
+		map[i] = layer_table_lookup(nlt, olt->layers[i].name);
+
+		if (map[i] != -1)
+			state.layers[map[i]] = kbd->state.layers[i];
+	}
+
+	for (i = 0, n = 0; i < kbd->state.nr_active_layers; i++) {
+		int idx = map[kbd->state.active_layers[i]];
+
+		if (idx != -1 && state.layers[idx].flags)
+			state.active_layers[n++] = idx;
+	}
+	state.nr_active_layers = n;
+
+	kbd_restore_state(kbd, &state);
+
+	for (i = 0; i < nlt->nr; i++)
+		for (n = layer_mod_refs(kbd->state.layers[i].flags); n > 0; n--)
+			send_mods(kbd, nlt->layers[i].mods, 1);
+
+	/* Runtime bindings refer to the layers of the old config. */
+	overlay_clear(kbd);
+	reclaim_storage(kbd);
+
+	config_release(kbd->config);
+	kbd->config = kbd->pending_config;
+	kbd->pending_config = NULL;
+	kbd->active_macro = NULL;
+
+	kbd->leds_unknown = 1;
+	update_leds(kbd);
 }
 
+/*
+ * Replace the keyboard's config with the supplied one (consuming the
+ * caller's reference) as soon as no keys are held.
+ */
+void kbd_reload(struct keyboard *kbd, struct config *config)
+{
+	if (kbd->pending_config)
+		config_release(kbd->pending_config);
+
+	kbd->pending_config = config;
+
+	try_reload(kbd);
+	flush_output(kbd);
+}
 
 /*
  * Here be tiny dragons.
@@ -546,56 +1640,62 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code, struct descri
  * The return value corresponds to a timeout before which the next invocation
  * of kbd_process_key_event must take place. A return value of 0 permits the
  * main loop to call at liberty.
+ *
+ * All time based behaviour (macro delays and repetition, timeout()) is
+ * driven by per keyboard timers. Events which arrive while a macro is
+ * suspended are queued and processed once it has completed.
  */
 long kbd_process_key_event(struct keyboard *kbd,
 			   uint8_t code,
 			   int pressed)
 {
-	uint8_t descriptor_layer_mods;
-	struct descriptor d;
-
-	/* timeout */
-	if (!code) {
-		if (active_macro) {
-			execute_macro(kbd, active_macro, active_macro_mods);
-			return kbd->config.macro_repeat_timeout;
-		} else if (kbd->pending_timeout.code) {
-			uint8_t mods = kbd->pending_timeout.mods;
-			uint8_t code = kbd->pending_timeout.code;
-			struct descriptor *d = &kbd->pending_timeout.t.d2;
+	struct kbd_event ev;
+	long deadline;
 
-			cache_set(kbd, code, d, mods);
+	ev.code = code;
+	ev.pressed = pressed;
+	ev.timestamp = kbd_now(kbd);
 
-			kbd->pending_timeout.code = 0;
-			return process_descriptor(kbd, code, d, mods, 1);
-		}
-	}
+	deadline = kbd_process_events(kbd, &ev, 1);
 
-	if (kbd->pending_timeout.code) {
-		uint8_t mods = kbd->pending_timeout.mods;
-		uint8_t code = kbd->pending_timeout.code;
-		struct descriptor *d = &kbd->pending_timeout.t.d1;
+	if (!deadline)
+		return 0;
 
-		cache_set(kbd, code, d, mods);
-		process_descriptor(kbd, code, d, mods, 1);
+	return deadline > ev.timestamp ? deadline - ev.timestamp : 1;
+}
 
-		kbd->pending_timeout.code = 0;
-	}
+/*
+ * Process a series of timestamped events in order, firing any timers which
+ * expire between them, and flush the resultant output in one go. Events
+ * with a code of 0 only advance time.
+ *
+ * Returns the absolute time at which the keyboard must next be processed,
+ * or 0 if no timers are pending.
+ */
+long kbd_process_events(struct keyboard *kbd, const struct kbd_event *events, size_t n)
+{
+	size_t i;
+	int t;
+	PROFILE_START(start);
 
-	if (active_macro)
-		active_macro = NULL;
+	for (i = 0; i < n; i++) {
+		const struct kbd_event *ev = &events[i];
 
-	if (pressed) {
-		lookup_descriptor(kbd, code, &descriptor_layer_mods, &d);
+		process_timers(kbd, ev->timestamp);
 
-		if (cache_set(kbd, code, &d, descriptor_layer_mods) < 0)
-			return 0;
-	} else {
-		if (cache_get(kbd, code, &d, &descriptor_layer_mods) < 0)
-			return 0;
+		if (ev->code)
+			queue_event(kbd, ev->code, ev->pressed);
 
-		cache_set(kbd, code, NULL, 0);
+		drain_queue(kbd);
 	}
 
-	return process_descriptor(kbd, code, &d, descriptor_layer_mods, pressed);
+	try_reload(kbd);
+	reclaim_storage(kbd);
+	flush_output(kbd);
+
+	t = timer_next(kbd);
+
+	PROFILE_END(PROFILE_EVENT, start);
+
+	return t == -1 ? 0 : kbd->timers[t].deadline;
 }
@@ -8,22 +8,174 @@
 
 #include "config.h"
 #include "layer.h"
+#include "vkbd.h"
 
 #define MAX_ACTIVE_KEYS	32
 #define CACHE_SIZE	16 //Effectively nkro
+#define MAX_QUEUED_EVENTS	64
+#define MAX_OUTPUT_EVENTS	128
+#define MAX_TIMERS	32
+#define MAX_PENDING_TIMEOUTS	8
+#define MAX_ACTIVE_CHORDS	4
+#define MAX_OVERLAY_ENTRIES	128
+
+#define LED_CAPSLOCK	1
+
+#define TIMER_MACRO		1 /* Resumes a suspended macro. */
+#define TIMER_MACRO_REPEAT	2
+#define TIMER_TIMEOUT		3 /* Expires a pending timeout(). */
+#define TIMER_CHORD		4 /* Resolves a partially entered chord. */
+#define TIMER_LEADER		5 /* Aborts an incomplete leader() sequence. */
+#define TIMER_OVERLOAD		6 /* Resolves a pending overload() as held. */
 
 struct cache_entry {
 	uint8_t code;
 	struct descriptor d;
 	uint8_t layermods;
+
+	/* The table containing the storage of d. */
+	const struct layer_table *lt;
+};
+
+struct timer {
+	long deadline;
+
+	uint8_t type;
+	uint8_t code;
+};
+
+struct pending_timeout {
+	uint8_t code;
+	uint8_t mods;
+	struct timeout t;
+	const struct layer_table *lt;
+
+	int timer;
+};
+
+/*
+ * The source of time (in ms) for a keyboard. The monotonic clock reports
+ * the system time, while a simulated clock reports `time`, which is
+ * advanced explicitly by its owner (e.g a test harness). This allows the
+ * engine to be driven deterministically.
+ */
+struct kbd_clock {
+	long (*now)(const struct kbd_clock *clock);
+	long time;
+};
+
+/* An input event and the time (in ms) at which it occurred. */
+struct kbd_event {
+	uint8_t code;
+	uint8_t pressed;
+
+	long timestamp;
+};
+
+struct layer_state {
+	uint8_t flags;
+};
+
+/*
+ * Dynamic keyboard state which persists across resets and can be cheaply
+ * saved and restored (e.g when swapping configs).
+ */
+struct kbd_state {
+	struct layer_state layers[MAX_LAYERS];
+
+	/*
+	 * Layer indices in order of activation (most recent last). May
+	 * contain layers which have since become inactive.
+	 */
+	uint8_t active_layers[MAX_LAYERS];
+	size_t nr_active_layers;
+
+	/* Output keys which are currently depressed. */
+	uint8_t keystate[256];
+
+	/* Reference counts of active modifiers. */
+	uint8_t modstate[MAX_MOD];
+
+	uint8_t oneshot_latch;
+};
+
+/*
+ * The storage (macros, timeouts and programs) of a runtime binding. This is
+ * kept apart from the config, which may be shared, and is freed as soon as
+ * the binding has been overwritten and no copies of it remain in use.
+ */
+struct overlay_storage {
+	struct layer_table lt;
+
+	/* The number of overlay entries which refer to the storage. */
+	int refs;
+
+	/* The next storage awaiting reclamation. */
+	struct overlay_storage *next;
+};
+
+/* A binding applied at runtime (e.g via IPC). */
+struct overlay_entry {
+	uint8_t layer;
+	uint8_t code;
+
+	struct descriptor d;
+	struct overlay_storage *storage;
+};
+
+struct active_chord {
+	/* Constituent keys which have yet to be released. */
+	struct keyset keys;
+
+	uint8_t code;
+	uint8_t mods;
+	struct descriptor d;
+
+	int released;
 };
 
 struct keyboard {
 	struct device *dev;
 
-	struct config config;
+	/* Defaults to kbd_monotonic_clock if NULL. */
+	const struct kbd_clock *clock;
 
-	struct layer_table layer_table;
+	/* The time of the event (or timer) currently being processed. */
+	long now;
+
+	/*
+	 * The absolute time (in ms) at which kbd_process_key_event() must next
+	 * be invoked with a 0 code, or 0 if no timeout is pending. Maintained
+	 * by the caller.
+	 */
+	long deadline;
+
+	/*
+	 * A reference to a (potentially shared) config, which is treated as
+	 * read-only. Runtime bindings are stored in the overlay.
+	 */
+	struct config *config;
+
+	/* A config to be swapped in once the keyboard is quiescent (see kbd_reload()). */
+	struct config *pending_config;
+
+	/*
+	 * Runtime bindings, consulted before the keymap of the corresponding
+	 * layer.
+	 */
+	struct {
+		struct overlay_entry entries[MAX_OVERLAY_ENTRIES];
+		size_t nr;
+
+		/* Keys with at least one runtime binding. */
+		struct keyset codes;
+
+		/*
+		 * Storage of bindings which have been overwritten, to be
+		 * freed once the keyboard is quiescent.
+		 */
+		struct overlay_storage *retired;
+	} overlay;
 
 	/* state*/
 
@@ -34,18 +186,110 @@ struct keyboard {
 	uint8_t last_pressed_keycode;
 	uint8_t last_layer_code;
 
+	/* timeout() keys awaiting resolution, in order of depression. */
+	struct pending_timeout pending_timeouts[MAX_PENDING_TIMEOUTS];
+	size_t nr_pending_timeouts;
+
+	/* Active timers, indexed by the set bits of active_timers. */
+	struct timer timers[MAX_TIMERS];
+	uint32_t active_timers;
+
+	/* The index of the earliest timer, or -1 if it must be recomputed. */
+	int next_timer;
+
+	/* The macro currently being repeated (if any). */
+	const struct macro *active_macro;
+	const struct layer_table *active_macro_lt;
+	uint8_t active_macro_mods;
+
+	/* Execution state of a (potentially suspended) macro. */
 	struct {
-		uint8_t code;
+		const struct macro *macro;
+		const struct layer_table *lt;
+		size_t idx;
 		uint8_t mods;
-		struct timeout t;
-	} pending_timeout;
 
-	uint8_t keystate[256];
-	uint8_t modstate[MAX_MOD];
+		/* The timer which resumes execution. */
+		int timer;
+
+		/* Repetition is scheduled relative to completion. */
+		long repeat_timeout;
+	} macro_state;
+
+	/* Keys which may constitute a chord, in order of depression. */
+	struct {
+		struct key_event events[MAX_CHORD_KEYS];
+		size_t n;
+
+		struct keyset keys;
+		int timer;
+	} chord_state;
+
+	struct active_chord active_chords[MAX_ACTIVE_CHORDS];
+
+	/* State of an in-progress leader() sequence. */
+	struct {
+		int active;
+		uint16_t node;
+		int timer;
+
+		/* Keys consumed by the sequence. */
+		uint8_t keys[MAX_LEADER_KEYS];
+		size_t n;
+
+		/* Consumed keys whose release should be swallowed. */
+		struct keyset held;
+	} leader_state;
+
+	/*
+	 * An overload() key whose tap/hold status is yet to be determined.
+	 * Subsequent events remain queued until it is resolved.
+	 */
+	struct {
+		int active;
+		uint8_t code;
+		int timer;
+	} overload_state;
+
+	/* Events received while a macro is suspended or an overload is pending. */
+	struct key_event queue[MAX_QUEUED_EVENTS];
+	size_t nr_queued;
+
+	/* Keys which are physically held, for each of which room is reserved in the queue. */
+	struct keyset held_keys;
+
+	/* Keys struck while the queue was full, whose release is dropped as well. */
+	struct keyset dropped_keys;
+
+	/* The state of the indicator LEDs as last written to the device. */
+	uint8_t leds;
+
+	/*
+	 * Set when the state of the device's LEDs is unknown (i.e after
+	 * attaching or reloading), in which case all LEDs managed by the
+	 * config are written on the next update.
+	 */
+	int leds_unknown;
+
+	/* Output which has yet to be flushed to the virtual keyboard. */
+	struct key_event output[MAX_OUTPUT_EVENTS];
+	size_t nr_output;
+
+	struct kbd_state state;
 };
 
+extern const struct kbd_clock kbd_monotonic_clock;
+
+void	kbd_simulated_clock(struct kbd_clock *clock, long time);
+
 long	kbd_process_key_event(struct keyboard *kbd, uint8_t code, int pressed);
+long	kbd_process_events(struct keyboard *kbd, const struct kbd_event *events, size_t n);
+void	kbd_init(struct keyboard *kbd);
+void	kbd_free(struct keyboard *kbd);
 void	kbd_reset(struct keyboard *kbd);
+void	kbd_save_state(const struct keyboard *kbd, struct kbd_state *state);
+void	kbd_restore_state(struct keyboard *kbd, const struct kbd_state *state);
 int	kbd_execute_expression(struct keyboard *kbd, const char *exp);
+void	kbd_reload(struct keyboard *kbd, struct config *config);
 
 #endif
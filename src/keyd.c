@@ -16,6 +16,7 @@ static const char *socket_file;
 static struct device devices[MAX_DEVICES];
 static size_t nr_devices = 0;
 static struct keyboard *active_kbd = NULL;
+static int status_fd = -1;
 
 /* loop() callback functions */
 
@@ -36,10 +37,13 @@ static void daemon_remove_cb(struct device *dev)
 {
 	struct keyboard *kbd = dev->data;
 
-	if (kbd)
+	if (kbd) {
+		kbd_free(kbd);
 		free(kbd);
+	}
 
 	active_kbd = NULL;
+	status_publish(NULL);
 
 	printf("device removed: %04x:%04x %s (%s)\n",
 	       dev->vendor_id,
@@ -48,9 +52,35 @@ static void daemon_remove_cb(struct device *dev)
 	       dev->path);
 }
 
-static void daemon_add_cb(struct device *dev)
+static void attach_keyboard(struct device *dev, const char *config_path)
 {
 	struct keyboard *kbd;
+
+	kbd = calloc(1, sizeof(struct keyboard));
+	if (!(kbd->config = config_get(config_path))) {
+		free(kbd);
+		printf("\tfailed to parse %s\n", config_path);
+		return;
+	}
+
+	if (device_grab(dev) < 0) {
+		config_release(kbd->config);
+		free(kbd);
+		printf("\tgrab failed\n");
+		return;
+	}
+
+	printf("\tmatched %s\n", config_path);
+
+	kbd->dev = dev;
+	kbd->clock = &kbd_monotonic_clock;
+	dev->data = kbd;
+
+	kbd_init(kbd);
+}
+
+static void daemon_add_cb(struct device *dev)
+{
 	const char *config_path = config_find_path(config_dir, dev->vendor_id, dev->product_id);
 
 	dev->data = NULL;
@@ -76,26 +106,69 @@ static void daemon_add_cb(struct device *dev)
 		return;
 	}
 
-	kbd = calloc(1, sizeof(struct keyboard));
-	if (config_parse(&kbd->config, config_path) < 0) {
-		free(kbd);
-		printf("\tfailed to parse %s\n", config_path);
-		return;
-	}
+	attach_keyboard(dev, config_path);
+}
 
-	if (device_grab(dev) < 0) {
-		free(kbd);
-		printf("\tgrab failed\n");
-		return;
-	}
+static int same_source(const struct config *a, const struct config *b)
+{
+	return a->dev == b->dev &&
+		a->ino == b->ino &&
+		a->mtime.tv_sec == b->mtime.tv_sec &&
+		a->mtime.tv_nsec == b->mtime.tv_nsec &&
+		!strcmp(a->path, b->path);
+}
 
-	printf("\tmatched %s\n", config_path);
+/*
+ * Called when the contents of the config directory change. Keyboards whose
+ * config has changed have the new one swapped in by the engine once no keys
+ * are held (preserving layer state), and keyboards which were previously
+ * ignored are attached if they now have a matching config.
+ */
+static void reload_configs()
+{
+	size_t i;
 
+	for (i = 0; i < nr_devices; i++) {
+		struct device *dev = &devices[i];
+		struct keyboard *kbd = dev->data;
+		struct config *config;
+		const char *config_path;
 
-	memcpy(&kbd->layer_table, &kbd->config.layer_table, sizeof(kbd->layer_table));
+		if (!dev->is_keyboard || dev->fd == -1)
+			continue;
 
-	kbd->dev = dev;
-	dev->data = kbd;
+		config_path = config_find_path(config_dir, dev->vendor_id, dev->product_id);
+
+		if (!config_path) {
+			if (kbd)
+				printf("%s no longer has a matching config (restart keyd to release it)\n", dev->name);
+			continue;
+		}
+
+		if (!kbd) {
+			printf("device matched: %04x:%04x %s (%s)\n",
+			       dev->vendor_id,
+			       dev->product_id,
+			       dev->name,
+			       dev->path);
+
+			attach_keyboard(dev, config_path);
+			continue;
+		}
+
+		if (!(config = config_get(config_path)))
+			continue;
+
+		if (same_source(config, kbd->pending_config ? kbd->pending_config : kbd->config)) {
+			config_release(config);
+			continue;
+		}
+
+		printf("reloading %s for %s\n", config_path, dev->name);
+		kbd_reload(kbd, config);
+	}
+
+	status_publish(active_kbd);
 }
 
 static void panic_check(uint8_t code, uint8_t pressed)
@@ -117,13 +190,51 @@ static void panic_check(uint8_t code, uint8_t pressed)
 		exit(-1);
 }
 
+/* Use the same time base as the keyboards. */
+static long get_time_ms()
+{
+	return kbd_monotonic_clock.now(&kbd_monotonic_clock);
+}
+
+/*
+ * Fire any expired keyboard timeouts and return the time remaining until
+ * the next one (or 0 if none are pending).
+ */
+static int process_timeouts()
+{
+	size_t i;
+	long now = get_time_ms();
+	long next = 0;
+
+	for (i = 0; i < nr_devices; i++) {
+		struct keyboard *kbd = devices[i].data;
+
+		if (!kbd || !kbd->deadline)
+			continue;
+
+		if (kbd->deadline <= now) {
+			long timeout = kbd_process_key_event(kbd, 0, 0);
+			kbd->deadline = timeout ? now + timeout : 0;
+		}
+
+		if (kbd->deadline && (!next || kbd->deadline < next))
+			next = kbd->deadline;
+	}
+
+	return next ? next - now : 0;
+}
+
 static int daemon_event_cb(struct device *dev, uint8_t code, uint8_t pressed)
 {
 	struct keyboard *kbd = NULL;
+	long timeout;
+	int ret;
 
 	if (!dev) {
-		/* timeout */
-		kbd = active_kbd;
+		ret = process_timeouts();
+		status_publish(active_kbd);
+
+		return ret;
 	} else if (dev->data) {
 		kbd = dev->data;
 	} else if (code >= KEYD_LEFT_MOUSE && code <= KEYD_MOUSE_2) {
@@ -138,7 +249,13 @@ static int daemon_event_cb(struct device *dev, uint8_t code, uint8_t pressed)
 	panic_check(code, pressed);
 	active_kbd = kbd;
 
-	return kbd_process_key_event(kbd, code, pressed);
+	timeout = kbd_process_key_event(kbd, code, pressed);
+	kbd->deadline = timeout ? get_time_ms() + timeout : 0;
+
+	ret = process_timeouts();
+	status_publish(active_kbd);
+
+	return ret;
 }
 
 static int ipc_cb(int fd, const char *input)
@@ -149,6 +266,15 @@ static int ipc_cb(int fd, const char *input)
 		char s[] = "pong\n";
 		write(fd, s, sizeof s);
 
+		return 0;
+	} else if (!strcmp(input, "status")) {
+		if (status_fd < 0)
+			return -1;
+
+		return ipc_send_fd(fd, status_fd);
+	} else if (!strcmp(input, "profile")) {
+		profile_dump(fd);
+
 		return 0;
 	} else if (!strcmp(input, "reset")) {
 		if (!active_kbd)
@@ -167,6 +293,7 @@ static int ipc_cb(int fd, const char *input)
 		}
 	}
 
+	status_publish(active_kbd);
 	return ret;
 }
 
@@ -219,13 +346,6 @@ static void set_echo(int set)
 	tcsetattr(1, TCSANOW, &tinfo);
 }
 
-static long get_time_ms()
-{
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec*1E3+ts.tv_nsec/1E6;
-}
-
 static void chgid()
 {
 	struct group *g = getgrnam("keyd");
@@ -264,10 +384,13 @@ static int loop(int monitor_mode)
 
 	int monfd = devmon_create();
 	int ipcfd = -1;
+	int cfgfd = -1;
 
-	struct pollfd pfds[MAX_DEVICES];
+	/* stdout, devmon, ipc, config watch */
+	struct pollfd pfds[MAX_DEVICES + 4];
 
 	int nfds = 0;
+	int cfg_idx;
 
 	if (monitor_mode) {
 		init_devices(devices, 0);
@@ -280,6 +403,12 @@ static int loop(int monitor_mode)
 		}
 
 		printf("socket: %s\n", socket_file);
+
+		status_fd = status_init();
+		if (status_fd < 0)
+			fprintf(stderr, "WARNING: failed to create the status page, -s will be unavailable\n");
+
+		cfgfd = config_watch_create(config_dir);
 	}
 
 	pfds[nfds].fd = 1;
@@ -291,6 +420,10 @@ static int loop(int monitor_mode)
 	pfds[nfds].fd = ipcfd;
 	pfds[nfds++].events = POLLIN;
 
+	cfg_idx = nfds++;
+	pfds[cfg_idx].fd = cfgfd;
+	pfds[cfg_idx].events = POLLIN;
+
 	for (i = 0; i < nr_devices; i++)
 		device_add_cb(&devices[i]);
 
@@ -303,10 +436,13 @@ static int loop(int monitor_mode)
 			pfds[i+nfds].events = POLLIN;
 		}
 
-		if (timeout)
-			poll_timeout = get_time_ms() - timeout_start;
-		else
+		if (timeout) {
+			poll_timeout = timeout - (get_time_ms() - timeout_start);
+			if (poll_timeout < 0)
+				poll_timeout = 0;
+		} else {
 			poll_timeout = -1;
+		}
 
 		poll(pfds, nr_devices+nfds, poll_timeout);
 
@@ -346,6 +482,9 @@ static int loop(int monitor_mode)
 			ipc_server_process_connection(con, ipc_cb);
 		}
 
+		if (pfds[cfg_idx].revents && config_watch_read(cfgfd))
+			reload_configs();
+
 		for (i = 0; i < nr_devices; i++) {
 			if (pfds[i+nfds].revents) {
 				struct device *dev = &devices[i];
@@ -385,6 +524,10 @@ static void cleanup()
 
 	free_vkbd(vkbd);
 
+#ifdef KEYD_PROFILE
+	profile_dump(2);
+#endif
+
 	if (isatty(1))
 		set_echo(1);
 }
@@ -417,6 +560,8 @@ static void print_help()
 			"Options:\n"
 			"    -m, --monitor      Start keyd in monitor mode.\n"
 			"    -l, --list-keys    List key names.\n"
+			"    -s, --status       Print the state of the active keyboard.\n"
+			"    -c, --compile      Compile configs into binary images.\n"
 			"    -v, --version      Print the current version and exit.\n"
 			"    -h, --help         Print help and exit.\n");
 }
@@ -435,6 +580,82 @@ static void eval_expressions(char *exps[], int n)
 	exit(ret);
 }
 
+static void print_status()
+{
+	size_t i;
+	struct keyd_status status;
+	const struct keyd_status *page;
+
+	int fd = ipc_recv_fd(socket_file, "status");
+
+	if (fd < 0 || !(page = status_map(fd))) {
+		fprintf(stderr, "ERROR: failed to obtain keyboard status\n");
+		exit(-1);
+	}
+
+	status_read(page, &status);
+
+	printf("layers:");
+	for (i = 0; i < status.nr_layers; i++)
+		if (STATUS_HAS(status.active, i))
+			printf(" %s%s%s", status.layers[i],
+			       STATUS_HAS(status.toggled, i) ? "*" : "",
+			       STATUS_HAS(status.oneshot, i) ? "+" : "");
+	printf("\n");
+
+	printf("mods:");
+	for (i = 0; i < MAX_MOD; i++)
+		if (status.mods & modifier_table[i].mask)
+			printf(" %s", modifier_table[i].name);
+	printf("\n");
+
+	exit(0);
+}
+
+/*
+ * Compile the given configs (or all configs in the config directory if none
+ * are supplied) into binary images which are loaded in preference to them.
+ */
+static void compile_configs(char *paths[], int n)
+{
+	int i;
+	int ret = 0;
+
+	if (!n) {
+		DIR *dh = opendir(config_dir);
+		struct dirent *ent;
+
+		if (!dh) {
+			perror("opendir");
+			exit(-1);
+		}
+
+		while ((ent = readdir(dh))) {
+			char path[1024];
+			int len = snprintf(path, sizeof path, "%s/%s", config_dir, ent->d_name);
+
+			if (ent->d_type == DT_DIR || len < 5 || strcmp(path+len-5, ".conf"))
+				continue;
+
+			if (config_compile(path) < 0) {
+				fprintf(stderr, "ERROR: failed to compile %s\n", path);
+				ret = -1;
+			}
+		}
+
+		closedir(dh);
+		exit(ret);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (config_compile(paths[i]) < 0) {
+			fprintf(stderr, "ERROR: failed to compile %s\n", paths[i]);
+			ret = -1;
+		}
+	}
+
+	exit(ret);
+}
 
 #define setvar(var, name, default) \
 	var = getenv(name); \
@@ -468,6 +689,10 @@ int main(int argc, char *argv[])
 			monitor_flag = 1;
 		else if (!strcmp(argv[1], "-e") || !strcmp(argv[1], "--expression"))
 			eval_expressions(argv+2, argc-2);
+		else if (!strcmp(argv[1], "-s") || !strcmp(argv[1], "--status"))
+			print_status();
+		else if (!strcmp(argv[1], "-c") || !strcmp(argv[1], "--compile"))
+			compile_configs(argv+2, argc-2);
 		else
 			print_help();
 
@@ -8,6 +8,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
@@ -28,6 +29,8 @@
 #include "keyboard.h"
 #include "vkbd.h"
 #include "ipc.h"
+#include "status.h"
+#include "profile.h"
 
 #define MAX_MESSAGE_SIZE 4096
 
@@ -4,6 +4,7 @@
  * © 2019 Raheman Vaiya (see also: LICENSE).
  */
 #include <stdint.h>
+#include <string.h>
 #include "keys.h"
 
 const struct modifier_table_ent modifier_table[MAX_MOD] = {
@@ -268,6 +269,111 @@ const struct keycode_table_ent keycode_table[256] = {
 	[KEYD_NOOP] = { "noop", NULL, NULL },
 };
 
+/*
+ * An index of every name in keycode_table (including aliases and shifted
+ * names), built on first use. Resolving names is the bulk of the work
+ * involved in parsing a config, so this replaces a linear scan with a
+ * single probe in the common case.
+ */
+
+#define NAME_INDEX_SIZE 1024 /* Must be a power of 2 greater than the number of names. */
+
+static struct name_index_ent {
+	const char *name;
+	uint8_t code;
+	uint8_t shifted;
+} name_index[NAME_INDEX_SIZE];
+
+static uint32_t name_hash(const char *s)
+{
+	uint32_t h = 2166136261;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static void name_index_add(const char *name, uint8_t code, uint8_t shifted)
+{
+	uint32_t i = name_hash(name);
+
+	while (1) {
+		struct name_index_ent *ent = &name_index[i % NAME_INDEX_SIZE];
+
+		if (!ent->name) {
+			ent->name = name;
+			ent->code = code;
+			ent->shifted = shifted;
+			return;
+		}
+
+		/* The first (lowest) keycode with a given name wins. */
+		if (!strcmp(ent->name, name))
+			return;
+
+		i++;
+	}
+}
+
+static void name_index_build()
+{
+	size_t i;
+
+	for (i = 0; i < 256; i++) {
+		const struct keycode_table_ent *ent = &keycode_table[i];
+
+		if (!ent->name)
+			continue;
+
+		if (ent->shifted_name)
+			name_index_add(ent->shifted_name, i, 1);
+
+		name_index_add(ent->name, i, 0);
+
+		if (ent->alt_name)
+			name_index_add(ent->alt_name, i, 0);
+	}
+}
+
+/*
+ * Resolve a key name (or alias) to its keycode. If shifted is non-NULL
+ * shifted names (e.g '!') are also accepted and *shifted is set if name was
+ * one. Returns -1 if no such key exists.
+ */
+int lookup_keycode(const char *name, uint8_t *code, int *shifted)
+{
+	static int built;
+	uint32_t i = name_hash(name);
+
+	if (!built) {
+		name_index_build();
+		built = 1;
+	}
+
+	while (1) {
+		const struct name_index_ent *ent = &name_index[i % NAME_INDEX_SIZE];
+
+		if (!ent->name)
+			return -1;
+
+		if (!strcmp(ent->name, name)) {
+			if (ent->shifted && !shifted)
+				return -1;
+
+			*code = ent->code;
+			if (shifted)
+				*shifted = ent->shifted;
+
+			return 0;
+		}
+
+		i++;
+	}
+}
+
 uint8_t keycode_to_mod(uint8_t code)
 {
 	switch (code) {
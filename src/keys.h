@@ -20,6 +20,7 @@
 
 uint8_t	keycode_to_mod(uint8_t code);
 int	parse_modset(const char *s, uint8_t *mods);
+int	lookup_keycode(const char *name, uint8_t *code, int *shifted);
 
 struct keycode_table_ent {
 	const char *name;
@@ -0,0 +1,523 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyd.h"
+#include "layer.h"
+
+/* Pools are aligned within the arena to accommodate any element type. */
+#define ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct pool_info {
+	const char *name;
+
+	/* Offsets of the pool pointer and element count within struct layer_table. */
+	size_t data;
+	size_t nr;
+
+	size_t sz;
+	size_t max;
+};
+
+#define POOL(name, ptr, nr, max) { \
+	name, \
+	offsetof(struct layer_table, ptr), \
+	offsetof(struct layer_table, nr), \
+	sizeof(*((struct layer_table *)0)->ptr), \
+	max \
+}
+
+static const struct pool_info pools[NR_POOLS] = {
+	[POOL_LAYERS] = POOL("layers", layers, nr, MAX_LAYERS),
+	[POOL_LAYER_INDEX] = POOL("layer index size", layer_index, nr_layer_index, MAX_LAYER_INDEX_SIZE),
+	[POOL_KEYMAPS] = POOL("keymap entries", keymaps, nr_keymaps, MAX_KEYMAP_ENTRIES),
+	[POOL_TIMEOUTS] = POOL("timeouts", timeouts, nr_timeouts, MAX_TIMEOUTS),
+	[POOL_CHORDS] = POOL("chords", chords, nr_chords, MAX_CHORDS),
+	[POOL_LEADER_NODES] = POOL("leader nodes", leader_nodes, nr_leader_nodes, MAX_LEADER_NODES),
+	[POOL_MACROS] = POOL("macros", macros, nr_macros, MAX_MACROS),
+	[POOL_MACRO_EVENTS] = POOL("macro events", macro_events, nr_macro_events, MAX_MACRO_EVENTS),
+	[POOL_BYTECODE] = POOL("bytecode size", bytecode, nr_bytecode, MAX_BYTECODE_SIZE),
+};
+
+static void **pool_data(const struct layer_table *lt, int pool)
+{
+	return (void **)((char *)lt + pools[pool].data);
+}
+
+static size_t pool_nr(const struct layer_table *lt, int pool)
+{
+	return *(const size_t *)((const char *)lt + pools[pool].nr);
+}
+
+/*
+ * Ensure that the given pool has room for n more elements. New elements
+ * are zeroed. Must not be called on a packed table.
+ */
+int layer_table_reserve(struct layer_table *lt, enum pool pool, size_t n)
+{
+	const struct pool_info *info = &pools[pool];
+	void **data = pool_data(lt, pool);
+	size_t nr = pool_nr(lt, pool);
+	size_t cap = lt->cap[pool];
+	char *p;
+
+	assert(!lt->arena);
+
+	if (nr + n <= cap)
+		return 0;
+
+	if (nr + n > info->max) {
+		err("max %s (%zu) exceeded", info->name, info->max);
+		return -1;
+	}
+
+	cap = cap ? cap * 2 : 8;
+	if (cap < nr + n)
+		cap = nr + n;
+	if (cap > info->max)
+		cap = info->max;
+
+	p = realloc(*data, cap * info->sz);
+	if (!p) {
+		err("out of memory");
+		return -1;
+	}
+
+	memset(p + lt->cap[pool] * info->sz, 0, (cap - lt->cap[pool]) * info->sz);
+
+	*data = p;
+	lt->cap[pool] = cap;
+
+	return 0;
+}
+
+static uint32_t name_hash(const char *s)
+{
+	uint32_t h = 2166136261;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static void index_insert(struct layer_table *lt, size_t idx)
+{
+	size_t mask = lt->nr_layer_index - 1;
+	size_t i = name_hash(lt->layers[idx].name);
+
+	while (lt->layer_index[i & mask])
+		i++;
+
+	lt->layer_index[i & mask] = idx + 1;
+}
+
+/*
+ * Add layer idx (which must already be named) to the name index, growing
+ * the index if necessary.
+ */
+int layer_table_index_layer(struct layer_table *lt, size_t idx)
+{
+	size_t i;
+	size_t sz = lt->nr_layer_index;
+
+	if ((idx + 1) * 2 > sz) {
+		sz = sz ? sz * 2 : 16;
+
+		if (layer_table_reserve(lt, POOL_LAYER_INDEX, sz - lt->nr_layer_index) < 0)
+			return -1;
+
+		lt->nr_layer_index = sz;
+		memset(lt->layer_index, 0, sz * sizeof(lt->layer_index[0]));
+
+		for (i = 0; i < idx; i++)
+			index_insert(lt, i);
+	}
+
+	index_insert(lt, idx);
+	return 0;
+}
+
+/* Returns the index of the layer with the given name, or -1. */
+int layer_table_lookup(const struct layer_table *lt, const char *name)
+{
+	size_t mask = lt->nr_layer_index - 1;
+	size_t i = name_hash(name);
+
+	if (!lt->nr_layer_index)
+		return -1;
+
+	while (1) {
+		uint16_t slot = lt->layer_index[i & mask];
+
+		if (!slot)
+			return -1;
+
+		if (!strcmp(lt->layers[slot - 1].name, name))
+			return slot - 1;
+
+		i++;
+	}
+}
+
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t sz)
+{
+	const uint8_t *p = data;
+
+	while (sz--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static uint32_t entry_hash(const struct layer_table *lt, enum pool pool, size_t i)
+{
+	uint32_t h = 2166136261;
+
+	if (pool == POOL_MACROS) {
+		const struct macro *m = &lt->macros[i];
+
+		h = hash_bytes(h, &m->mods, sizeof m->mods);
+		return hash_bytes(h, &lt->macro_events[m->start], m->sz * sizeof(struct macro_event));
+	} else {
+		const struct timeout *t = &lt->timeouts[i];
+
+		/* Equivalent descriptors may have distinct programs. */
+		h = hash_bytes(h, &t->timeout, sizeof t->timeout);
+		h = hash_bytes(h, &t->d1.op, sizeof t->d1.op);
+		h = hash_bytes(h, t->d1.args, sizeof t->d1.args);
+		h = hash_bytes(h, &t->d2.op, sizeof t->d2.op);
+		return hash_bytes(h, t->d2.args, sizeof t->d2.args);
+	}
+}
+
+static int entry_equal(const struct layer_table *lt, enum pool pool, size_t a, size_t b)
+{
+	if (pool == POOL_MACROS) {
+		const struct macro *m1 = &lt->macros[a];
+		const struct macro *m2 = &lt->macros[b];
+
+		return m1->mods == m2->mods &&
+			m1->sz == m2->sz &&
+			!memcmp(&lt->macro_events[m1->start],
+				&lt->macro_events[m2->start],
+				m1->sz * sizeof(struct macro_event));
+	} else {
+		const struct timeout *t1 = &lt->timeouts[a];
+		const struct timeout *t2 = &lt->timeouts[b];
+
+		return t1->timeout == t2->timeout &&
+			t1->d1.op == t2->d1.op &&
+			t1->d2.op == t2->d2.op &&
+			!memcmp(t1->d1.args, t2->d1.args, sizeof t1->d1.args) &&
+			!memcmp(t1->d2.args, t2->d2.args, sizeof t1->d2.args);
+	}
+}
+
+/*
+ * Look up the entry following the last one in the given pool (which the
+ * caller has populated) and return the index of an identical existing entry
+ * if there is one. Otherwise the entry is added to the pool and its index
+ * returned.
+ */
+static int intern(struct layer_table *lt, enum pool pool, struct intern_index *ix)
+{
+	size_t *nr = (size_t *)((char *)lt + pools[pool].nr);
+	size_t mask;
+	size_t i;
+
+	if ((*nr + 1) * 2 > ix->sz) {
+		size_t sz = ix->sz ? ix->sz : 64;
+		uint32_t *slots;
+
+		while ((*nr + 1) * 2 > sz)
+			sz *= 2;
+
+		if (!(slots = realloc(ix->slots, sz * sizeof(uint32_t)))) {
+			err("out of memory");
+			return -1;
+		}
+
+		ix->slots = slots;
+		ix->sz = sz;
+		ix->nr = 0;
+	}
+
+	mask = ix->sz - 1;
+
+	if (!ix->nr)
+		memset(ix->slots, 0, ix->sz * sizeof(uint32_t));
+
+	for (; ix->nr <= *nr; ix->nr++) {
+		for (i = entry_hash(lt, pool, ix->nr); ix->slots[i & mask]; i++) {
+			size_t match = ix->slots[i & mask] - 1;
+
+			if (ix->nr == *nr && entry_equal(lt, pool, match, *nr))
+				return match;
+		}
+
+		ix->slots[i & mask] = ix->nr + 1;
+	}
+
+	return (*nr)++;
+}
+
+/*
+ * Add the macro at lt->macros[lt->nr_macros] (whose events occupy the end of
+ * the event pool), sharing an existing one if it is identical. Returns the
+ * index of the resulting macro.
+ */
+int layer_table_add_macro(struct layer_table *lt)
+{
+	size_t nr = lt->nr_macros;
+	size_t start = lt->macros[nr].start;
+	int idx;
+
+	lt->nr_macro_defs++;
+
+	if ((idx = intern(lt, POOL_MACROS, &lt->macro_index)) < 0)
+		return -1;
+
+	/* Discard the events of a duplicate. */
+	if ((size_t)idx != nr)
+		lt->nr_macro_events = start;
+
+	return idx;
+}
+
+/*
+ * Add the timeout at lt->timeouts[lt->nr_timeouts], sharing an existing one
+ * if it is identical. Returns the index of the resulting timeout.
+ */
+int layer_table_add_timeout(struct layer_table *lt)
+{
+	lt->nr_timeout_defs++;
+
+	return intern(lt, POOL_TIMEOUTS, &lt->timeout_index);
+}
+
+/* Allocate an empty dense keymap for a newly created layer. */
+int layer_table_add_keymap(struct layer_table *lt, struct layer *layer)
+{
+	if (layer_table_reserve(lt, POOL_KEYMAPS, 256) < 0)
+		return -1;
+
+	memset(&layer->keys, 0, sizeof layer->keys);
+	layer->keymap = lt->nr_keymaps;
+	layer->sparse = 0;
+
+	lt->nr_keymaps += 256;
+
+	return 0;
+}
+
+void layer_table_bind(struct layer_table *lt, struct layer *layer, uint8_t code, const struct descriptor *d)
+{
+	assert(!layer->sparse);
+
+	lt->keymaps[layer->keymap + code] = *d;
+	keyset_add(&layer->keys, code);
+}
+
+/*
+ * Rebuild the keymap pool, storing the keymaps of layers with fewer than
+ * SPARSE_KEYMAP_THRESHOLD bindings sparsely.
+ */
+static int compact_keymaps(struct layer_table *lt)
+{
+	size_t i;
+	size_t n = 0;
+	struct descriptor *keymaps;
+
+	for (i = 0; i < lt->nr; i++) {
+		const struct layer *layer = &lt->layers[i];
+		size_t count = keyset_count(&layer->keys);
+
+		n += (layer->sparse || count < SPARSE_KEYMAP_THRESHOLD) ? count : 256;
+	}
+
+	keymaps = calloc(n ? n : 1, sizeof(struct descriptor));
+	if (!keymaps) {
+		err("out of memory");
+		return -1;
+	}
+
+	n = 0;
+	for (i = 0; i < lt->nr; i++) {
+		struct layer *layer = &lt->layers[i];
+		const struct descriptor *km = &lt->keymaps[layer->keymap];
+		size_t count = keyset_count(&layer->keys);
+
+		layer->keymap = n;
+
+		if (layer->sparse) {
+			memcpy(&keymaps[n], km, count * sizeof(struct descriptor));
+			n += count;
+		} else if (count < SPARSE_KEYMAP_THRESHOLD) {
+			size_t code;
+
+			for (code = 0; code < 256; code++)
+				if (keyset_has(&layer->keys, code))
+					keymaps[n++] = km[code];
+
+			layer->sparse = 1;
+		} else {
+			memcpy(&keymaps[n], km, 256 * sizeof(struct descriptor));
+			n += 256;
+		}
+	}
+
+	free(lt->keymaps);
+
+	lt->keymaps = keymaps;
+	lt->nr_keymaps = n;
+	lt->cap[POOL_KEYMAPS] = n;
+
+	return 0;
+}
+
+/* The size of the arena required to hold the contents of the table. */
+size_t layer_table_arena_size(const struct layer_table *lt)
+{
+	size_t i;
+	size_t sz = 0;
+
+	for (i = 0; i < NR_POOLS; i++)
+		sz += ALIGN(pool_nr(lt, i) * pools[i].sz);
+
+	return sz;
+}
+
+/*
+ * Point the pools of the table at their location within the given arena
+ * (which must be at least layer_table_arena_size() bytes).
+ */
+void layer_table_relocate(struct layer_table *lt, void *arena)
+{
+	size_t i;
+	size_t off = 0;
+
+	for (i = 0; i < NR_POOLS; i++) {
+		size_t nr = pool_nr(lt, i);
+
+		*pool_data(lt, i) = (char *)arena + off;
+		lt->cap[i] = nr;
+
+		off += ALIGN(nr * pools[i].sz);
+	}
+
+	memset(&lt->macro_index, 0, sizeof lt->macro_index);
+	memset(&lt->timeout_index, 0, sizeof lt->timeout_index);
+
+	lt->arena = arena;
+	lt->arena_sz = off;
+}
+
+/* Initialize dst with a packed copy of src. */
+int layer_table_copy(struct layer_table *dst, const struct layer_table *src)
+{
+	size_t i;
+	size_t sz = layer_table_arena_size(src);
+	void *arena = calloc(1, sz ? sz : 1);
+
+	if (!arena) {
+		err("out of memory");
+		return -1;
+	}
+
+	*dst = *src;
+	layer_table_relocate(dst, arena);
+
+	for (i = 0; i < NR_POOLS; i++) {
+		size_t nr = pool_nr(src, i);
+
+		if (nr)
+			memcpy(*pool_data(dst, i), *pool_data(src, i), nr * pools[i].sz);
+	}
+
+	return 0;
+}
+
+/*
+ * Move the contents of the table into a single allocation of the minimum
+ * size. Layers are no longer modifiable once packed.
+ */
+int layer_table_pack(struct layer_table *lt)
+{
+	struct layer_table packed;
+
+	if (lt->arena)
+		return 0;
+
+	if (compact_keymaps(lt) < 0)
+		return -1;
+
+	if (layer_table_copy(&packed, lt) < 0)
+		return -1;
+
+	layer_table_free(lt);
+	*lt = packed;
+
+	return 0;
+}
+
+/*
+ * Initialize lt as an empty table which shares the layers of `base` (for
+ * the purpose of name lookups) but allocates everything else from pools of
+ * its own. This allows storage to be added for a packed (and potentially
+ * shared) table without modifying it. `base` must outlive lt, which is
+ * freed with layer_table_release_extension().
+ */
+void layer_table_extend(struct layer_table *lt, const struct layer_table *base)
+{
+	memset(lt, 0, sizeof *lt);
+
+	lt->layers = base->layers;
+	lt->nr = base->nr;
+	lt->layer_index = base->layer_index;
+	lt->nr_layer_index = base->nr_layer_index;
+}
+
+void layer_table_release_extension(struct layer_table *lt)
+{
+	lt->layers = NULL;
+	lt->layer_index = NULL;
+
+	layer_table_free(lt);
+}
+
+void layer_table_free(struct layer_table *lt)
+{
+	size_t i;
+
+	if (lt->arena) {
+		free(lt->arena);
+	} else {
+		for (i = 0; i < NR_POOLS; i++)
+			free(*pool_data(lt, i));
+	}
+
+	for (i = 0; i < NR_POOLS; i++) {
+		*pool_data(lt, i) = NULL;
+		lt->cap[i] = 0;
+	}
+
+	free(lt->macro_index.slots);
+	free(lt->timeout_index.slots);
+
+	memset(&lt->macro_index, 0, sizeof lt->macro_index);
+	memset(&lt->timeout_index, 0, sizeof lt->timeout_index);
+
+	lt->arena = NULL;
+	lt->arena_sz = 0;
+}
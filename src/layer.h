@@ -11,10 +11,26 @@
 
 #define MAX_LAYER_NAME_LEN	32
 #define MAX_COMPOSITE_LAYERS	8
-#define MAX_TIMEOUTS		32
 
-#define MAX_MACRO_SIZE	64
-#define MAX_MACROS	256
+/*
+ * Layer table pools are sized dynamically, the following limits are
+ * imposed by the width of the indices which refer to them (see enum
+ * instruction).
+ */
+#define MAX_TIMEOUTS		65536
+#define MAX_MACROS		65535 /* 0xffff denotes no macro. */
+#define MAX_MACRO_EVENTS	((size_t)-1)
+#define MAX_CHORDS		((size_t)-1)
+#define MAX_BYTECODE_SIZE	65536
+#define MAX_LEADER_NODES	65536
+#define MAX_KEYMAP_ENTRIES	(MAX_LAYERS * 256)
+#define MAX_LAYER_INDEX_SIZE	(MAX_LAYERS * 2)
+
+/* Layers with fewer bindings than this are stored sparsely. */
+#define SPARSE_KEYMAP_THRESHOLD	64
+
+#define MAX_CHORD_KEYS	8
+#define MAX_LEADER_KEYS		8
 
 #define LT_NORMAL	0
 #define LT_LAYOUT	1
@@ -25,6 +41,11 @@
 #define LF_ONESHOT	0x4
 #define LF_ONESHOT_HELD	0x8
 
+/* A 256 bit set of keycodes. */
+struct keyset {
+	uint64_t bits[4];
+};
+
 /*
  * A layer is a map from keycodes to descriptors. It may optionally
  * contain one or more modifiers which are applied to the base layout in
@@ -42,11 +63,15 @@ struct layer {
 	int type;
 	uint8_t mods;
 
-	struct descriptor keymap[256];
-
-	/* state */
-	uint8_t flags;
-	long activation_time;
+	/*
+	 * The keymap occupies the keymap pool from index `keymap`. A dense
+	 * keymap has an entry for every keycode, a sparse one has entries
+	 * only for the keys in `keys` (in keycode order). Layers are dense
+	 * until the table is packed.
+	 */
+	struct keyset keys;
+	uint32_t keymap;
+	uint8_t sparse;
 };
 
 struct timeout {
@@ -67,24 +92,224 @@ struct macro_entry {
 	uint16_t data;
 };
 
+#define MACRO_EVENT_PRESSED	0x1
+#define MACRO_EVENT_MOD		0x2 /* A reference counted modifier transition. */
+#define MACRO_EVENT_RESET	0x4 /* Release the key if it is down. */
+
 /*
- * A series of key sequences optionally punctuated by
- * timeouts
+ * A compiled output event. Execution is suspended for `delay` ms after the
+ * event is emitted. A code of 0 denotes a noop.
+ */
+struct macro_event {
+	uint8_t code;
+	uint8_t flags;
+	uint16_t delay;
+};
+
+/*
+ * A series of key sequences optionally punctuated by timeouts, compiled into
+ * a contiguous range of the macro event pool.
  */
 struct macro {
-	struct macro_entry entries[MAX_MACRO_SIZE];
+	size_t start;
+	size_t sz;
+
+	/* The modifiers of a macro consisting of a single key sequence. */
+	uint8_t mods;
+};
+
+/*
+ * A set of keys which produces the associated descriptor when struck
+ * simultaneously while the owning layer is active.
+ */
+struct chord {
+	struct keyset keys;
+	int layer;
+
+	struct descriptor d;
+};
+
+/*
+ * A node in the trie of leader() sequences. Children are linked through
+ * `next` and an index of 0 (the root) terminates a list. Nodes are appended
+ * as they are created, so links always refer to later nodes. The descriptor
+ * of a node which does not terminate a sequence is OP_UNDEFINED.
+ */
+struct leader_node {
+	uint8_t code;
+
+	uint16_t child;
+	uint16_t next;
+
+	struct descriptor d;
+};
+
+enum pool {
+	POOL_LAYERS,
+	POOL_LAYER_INDEX,
+	POOL_KEYMAPS,
+	POOL_TIMEOUTS,
+	POOL_CHORDS,
+	POOL_LEADER_NODES,
+	POOL_MACROS,
+	POOL_MACRO_EVENTS,
+	POOL_BYTECODE,
+
+	NR_POOLS
+};
+
+/*
+ * A hash table of the contents of a pool, used to share identical entries.
+ * Each slot contains the index of an entry plus one, or 0 if it is empty.
+ * This is a cache which is rebuilt as required and is not part of a packed
+ * table.
+ */
+struct intern_index {
+	uint32_t *slots;
 	size_t sz;
+
+	/* The number of pool entries which have been inserted. */
+	size_t nr;
 };
 
+/*
+ * The contents of a layer table are stored in pools which grow as
+ * required while the table is being populated. Once complete, the table is
+ * packed into a single allocation (the arena) sized to fit its contents.
+ * Since the pools contain only indices, a packed table can be copied (or
+ * serialized) and relocated with layer_table_relocate().
+ */
 struct layer_table {
-	struct layer layers[MAX_LAYERS];
+	struct layer *layers;
 	size_t nr;
 
-	struct timeout timeouts[MAX_TIMEOUTS];
-	struct macro macros[MAX_MACROS];
+	/*
+	 * An open addressed hash table of layer names. Each slot contains
+	 * the index of a layer plus one, or 0 if it is empty. The size is a
+	 * power of 2 and at least twice the number of layers.
+	 */
+	uint16_t *layer_index;
+	size_t nr_layer_index;
+
+	struct descriptor *keymaps;
+	size_t nr_keymaps;
+
+	struct timeout *timeouts;
+	struct chord *chords;
+	struct leader_node *leader_nodes;
+	struct macro *macros;
+	struct macro_event *macro_events;
+	uint8_t *bytecode;
 
 	size_t nr_macros;
+	size_t nr_macro_events;
+	size_t nr_bytecode;
 	size_t nr_timeouts;
+	size_t nr_chords;
+	size_t nr_leader_nodes;
+
+	/* Identical macros and timeouts share a single entry. */
+	struct intern_index macro_index;
+	struct intern_index timeout_index;
+
+	/* The number of macros and timeouts defined (including duplicates). */
+	size_t nr_macro_defs;
+	size_t nr_timeout_defs;
+
+	/* The number of elements allocated for each pool. */
+	size_t cap[NR_POOLS];
+
+	/* NULL if the pools are individually allocated. */
+	void *arena;
+	size_t arena_sz;
 };
 
+int	layer_table_reserve(struct layer_table *lt, enum pool pool, size_t n);
+int	layer_table_add_keymap(struct layer_table *lt, struct layer *layer);
+int	layer_table_index_layer(struct layer_table *lt, size_t idx);
+int	layer_table_lookup(const struct layer_table *lt, const char *name);
+int	layer_table_add_macro(struct layer_table *lt);
+int	layer_table_add_timeout(struct layer_table *lt);
+void	layer_table_bind(struct layer_table *lt, struct layer *layer, uint8_t code, const struct descriptor *d);
+int	layer_table_pack(struct layer_table *lt);
+int	layer_table_copy(struct layer_table *dst, const struct layer_table *src);
+void	layer_table_relocate(struct layer_table *lt, void *arena);
+size_t	layer_table_arena_size(const struct layer_table *lt);
+void	layer_table_free(struct layer_table *lt);
+void	layer_table_extend(struct layer_table *lt, const struct layer_table *base);
+void	layer_table_release_extension(struct layer_table *lt);
+
+static inline void keyset_add(struct keyset *set, uint8_t code)
+{
+	set->bits[code >> 6] |= (uint64_t)1 << (code & 63);
+}
+
+static inline void keyset_del(struct keyset *set, uint8_t code)
+{
+	set->bits[code >> 6] &= ~((uint64_t)1 << (code & 63));
+}
+
+static inline int keyset_has(const struct keyset *set, uint8_t code)
+{
+	return (set->bits[code >> 6] >> (code & 63)) & 1;
+}
+
+static inline int keyset_empty(const struct keyset *set)
+{
+	return !(set->bits[0] | set->bits[1] | set->bits[2] | set->bits[3]);
+}
+
+static inline size_t keyset_count(const struct keyset *set)
+{
+	return __builtin_popcountll(set->bits[0]) +
+	       __builtin_popcountll(set->bits[1]) +
+	       __builtin_popcountll(set->bits[2]) +
+	       __builtin_popcountll(set->bits[3]);
+}
+
+/* The number of members of the set less than code. */
+static inline size_t keyset_rank(const struct keyset *set, uint8_t code)
+{
+	size_t i;
+	size_t n = 0;
+
+	for (i = 0; i < (size_t)(code >> 6); i++)
+		n += __builtin_popcountll(set->bits[i]);
+
+	return n + __builtin_popcountll(set->bits[code >> 6] & (((uint64_t)1 << (code & 63)) - 1));
+}
+
+/* Returns non-zero if a is a subset of b. */
+static inline int keyset_subset(const struct keyset *a, const struct keyset *b)
+{
+	return !((a->bits[0] & ~b->bits[0]) |
+		 (a->bits[1] & ~b->bits[1]) |
+		 (a->bits[2] & ~b->bits[2]) |
+		 (a->bits[3] & ~b->bits[3]));
+}
+
+static inline int keyset_equal(const struct keyset *a, const struct keyset *b)
+{
+	return !((a->bits[0] ^ b->bits[0]) |
+		 (a->bits[1] ^ b->bits[1]) |
+		 (a->bits[2] ^ b->bits[2]) |
+		 (a->bits[3] ^ b->bits[3]));
+}
+
+/* Returns the descriptor bound to the given key (OP_UNDEFINED if there is none). */
+static inline const struct descriptor *layer_table_get(const struct layer_table *lt,
+						       const struct layer *layer,
+						       uint8_t code)
+{
+	static const struct descriptor undefined = { .op = OP_UNDEFINED };
+
+	if (!layer->sparse)
+		return &lt->keymaps[layer->keymap + code];
+
+	if (!keyset_has(&layer->keys, code))
+		return &undefined;
+
+	return &lt->keymaps[layer->keymap + keyset_rank(&layer->keys, code)];
+}
+
 #endif
@@ -0,0 +1,120 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "profile.h"
+
+#ifdef KEYD_PROFILE
+
+struct histogram {
+	uint64_t buckets[PROFILE_BUCKETS];
+
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+};
+
+static struct histogram histograms[MAX_PROFILE_HISTOGRAMS];
+
+static const char *names[MAX_PROFILE_HISTOGRAMS] = {
+	[OP_UNDEFINED] = "undefined",
+	[OP_KEYCODE] = "keycode",
+	[OP_ONESHOT] = "oneshot",
+	[OP_SWAP] = "swap",
+	[OP_LAYER] = "layer",
+	[OP_OVERLOAD] = "overload",
+	[OP_TOGGLE] = "toggle",
+	[OP_MACRO] = "macro",
+	[OP_TIMEOUT] = "timeout",
+	[OP_LEADER] = "leader",
+
+	[PROFILE_LOOKUP] = "lookup",
+	[PROFILE_FLUSH] = "flush",
+	[PROFILE_EVENT] = "event",
+};
+
+uint64_t profile_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profile_record(int hist, uint64_t start)
+{
+	struct histogram *h = &histograms[hist];
+	uint64_t ns = profile_time() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= PROFILE_BUCKETS)
+		bucket = PROFILE_BUCKETS - 1;
+
+	h->buckets[bucket]++;
+	h->count++;
+	h->total += ns;
+
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/* Returns the upper bound of the bucket containing the given percentile. */
+static uint64_t percentile(const struct histogram *h, int pct)
+{
+	size_t i;
+	uint64_t n = 0;
+	uint64_t target = (h->count * pct + 99) / 100;
+
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		n += h->buckets[i];
+		if (n >= target)
+			return (uint64_t)1 << i;
+	}
+
+	return h->max;
+}
+
+/* Write a summary of all non-empty histograms to fd. */
+void profile_dump(int fd)
+{
+	size_t i, j;
+
+	for (i = 0; i < MAX_PROFILE_HISTOGRAMS; i++) {
+		const struct histogram *h = &histograms[i];
+
+		if (!h->count)
+			continue;
+
+		dprintf(fd, "%s: n=%llu mean=%lluns p50<%lluns p99<%lluns max=%lluns\n",
+			names[i],
+			(unsigned long long)h->count,
+			(unsigned long long)(h->total / h->count),
+			(unsigned long long)percentile(h, 50),
+			(unsigned long long)percentile(h, 99),
+			(unsigned long long)h->max);
+
+		for (j = 0; j < PROFILE_BUCKETS; j++) {
+			if (!h->buckets[j])
+				continue;
+
+			dprintf(fd, "\t<%lluns\t%llu\n",
+				(unsigned long long)1 << j,
+				(unsigned long long)h->buckets[j]);
+		}
+	}
+}
+
+#else
+
+void profile_dump(int fd)
+{
+	const char msg[] = "profiling is disabled (rebuild with PROFILE=1)\n";
+
+	write(fd, msg, sizeof msg - 1);
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "descriptor.h"
+
+/*
+ * Optional latency instrumentation (build with PROFILE=1). Durations are
+ * recorded in nanoseconds into log2 bucketed histograms, one for each
+ * descriptor op (as executed by process_descriptor()) and one for each of
+ * the following stages.
+ */
+#define PROFILE_LOOKUP		(OP_LEADER+1) /* lookup_descriptor() */
+#define PROFILE_FLUSH		(OP_LEADER+2) /* Writes to the virtual keyboard. */
+#define PROFILE_EVENT		(OP_LEADER+3) /* A full kbd_process_events() call. */
+
+#define MAX_PROFILE_HISTOGRAMS	(OP_LEADER+4)
+
+/* Bucket n holds durations in [2^(n-1), 2^n) ns. */
+#define PROFILE_BUCKETS		32
+
+#ifdef KEYD_PROFILE
+
+uint64_t	profile_time();
+void	profile_record(int hist, uint64_t start);
+
+#define PROFILE_START(var)	uint64_t var = profile_time()
+#define PROFILE_END(hist, var)	profile_record(hist, var)
+
+#else
+
+#define PROFILE_START(var)
+#define PROFILE_END(hist, var)
+
+#endif
+
+void	profile_dump(int fd);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "status.h"
+
+/* Supported since Linux 5.1, but not defined by older C libraries. */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+/* The part of the status which is compared and republished on every event. */
+struct layer_state_masks {
+	uint8_t mods;
+
+	uint64_t active[MAX_LAYERS / 64];
+	uint64_t toggled[MAX_LAYERS / 64];
+	uint64_t oneshot[MAX_LAYERS / 64];
+};
+
+static struct keyd_status *shared;
+
+/* The last published masks. */
+static struct layer_state_masks current;
+
+/* Identifies the config whose layer names are currently published. */
+static struct {
+	const struct config *config;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+} names;
+
+/*
+ * Create the shared status page and return a read-only descriptor suitable
+ * for handing out to clients.
+ */
+int status_init()
+{
+	int ro;
+	char path[64];
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE;
+	int fd = memfd_create("keyd-status", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd < 0) {
+		perror("memfd_create");
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(struct keyd_status)) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	shared = mmap(NULL, sizeof(struct keyd_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		shared = NULL;
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 * Prevent clients from writing to the page (even by reopening the
+	 * descriptor they are given). Our own mapping predates the seal and
+	 * remains writable. The page is not handed out at all if this isn't
+	 * supported.
+	 */
+	if (fcntl(fd, F_ADD_SEALS, seals) < 0) {
+		perror("fcntl");
+		goto fail;
+	}
+
+	/* Clients receive a descriptor which was opened read-only. */
+	snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+	if ((ro = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror("open");
+		goto fail;
+	}
+
+	close(fd);
+	shared->version = STATUS_VERSION;
+
+	return ro;
+
+fail:
+	munmap(shared, sizeof(struct keyd_status));
+	shared = NULL;
+	close(fd);
+
+	return -1;
+}
+
+static void snapshot(const struct keyboard *kbd, struct layer_state_masks *masks)
+{
+	size_t i;
+
+	memset(masks, 0, sizeof *masks);
+
+	if (!kbd)
+		return;
+
+	/* Every layer with state set is on the activation stack. */
+	for (i = 0; i < kbd->state.nr_active_layers; i++) {
+		uint8_t idx = kbd->state.active_layers[i];
+		uint8_t flags = kbd->state.layers[idx].flags;
+		uint64_t bit = (uint64_t)1 << (idx % 64);
+
+		if (flags & LF_ACTIVE)
+			masks->active[idx / 64] |= bit;
+		if (flags & LF_TOGGLE)
+			masks->toggled[idx / 64] |= bit;
+		if (flags & LF_ONESHOT)
+			masks->oneshot[idx / 64] |= bit;
+	}
+
+	for (i = 0; i < MAX_MOD; i++)
+		if (kbd->state.modstate[i])
+			masks->mods |= modifier_table[i].mask;
+}
+
+static int names_current(const struct config *config)
+{
+	if (!config)
+		return !names.config;
+
+	return names.config == config &&
+		names.dev == config->dev &&
+		names.ino == config->ino &&
+		names.mtime.tv_sec == config->mtime.tv_sec &&
+		names.mtime.tv_nsec == config->mtime.tv_nsec;
+}
+
+/* Rewrite the layer names, must be called within the write side of the seqlock. */
+static void publish_names(const struct config *config)
+{
+	size_t i;
+
+	memset(shared->layers, 0, sizeof shared->layers);
+	shared->nr_layers = 0;
+
+	names.config = config;
+
+	if (!config)
+		return;
+
+	names.dev = config->dev;
+	names.ino = config->ino;
+	names.mtime = config->mtime;
+
+	shared->nr_layers = config->layer_table.nr;
+	for (i = 0; i < config->layer_table.nr; i++)
+		strcpy(shared->layers[i], config->layer_table.layers[i].name);
+}
+
+/*
+ * Publish the state of the given keyboard (which may be NULL). Cheap enough
+ * to call after every event: only the layer masks and modifiers are
+ * compared, and the shared page is only touched if they (or the config)
+ * changed.
+ */
+void status_publish(const struct keyboard *kbd)
+{
+	struct layer_state_masks masks;
+	const struct config *config = kbd ? kbd->config : NULL;
+	int names_changed;
+	uint32_t seq;
+
+	if (!shared)
+		return;
+
+	snapshot(kbd, &masks);
+
+	names_changed = !names_current(config);
+	if (!names_changed && !memcmp(&masks, &current, sizeof masks))
+		return;
+
+	current = masks;
+
+	seq = shared->seq;
+	__atomic_store_n(&shared->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (names_changed)
+		publish_names(config);
+
+	shared->mods = masks.mods;
+	memcpy(shared->active, masks.active, sizeof masks.active);
+	memcpy(shared->toggled, masks.toggled, sizeof masks.toggled);
+	memcpy(shared->oneshot, masks.oneshot, sizeof masks.oneshot);
+
+	__atomic_store_n(&shared->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Map a descriptor obtained from the daemon. */
+const struct keyd_status *status_map(int fd)
+{
+	void *p = mmap(NULL, sizeof(struct keyd_status), PROT_READ, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return p;
+}
+
+/* Obtain a consistent copy of the shared page. */
+void status_read(const struct keyd_status *page, struct keyd_status *status)
+{
+	uint32_t seq;
+
+	while (1) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(status, page, sizeof *status);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+}
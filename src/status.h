@@ -0,0 +1,48 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#ifndef STATUS_H
+#define STATUS_H
+
+#include "keyboard.h"
+
+#define STATUS_VERSION	3
+
+/* Tests bit i of a layer mask. */
+#define STATUS_HAS(mask, i) (((mask)[(i) / 64] >> ((i) % 64)) & 1)
+
+/*
+ * A snapshot of the active keyboard's state, published by the daemon into a
+ * shared memory page which clients (e.g status bars) obtain via the "status"
+ * IPC command and map read-only.
+ *
+ * Updates are guarded by a seqlock: seq is odd while the daemon is writing,
+ * so a reader copies the struct and retries until it observes the same even
+ * value of seq before and after the copy. Readers never block the daemon.
+ */
+struct keyd_status {
+	uint32_t seq;
+	uint32_t version;
+
+	/* MOD_* mask of the modifiers currently held on the virtual keyboard. */
+	uint8_t mods;
+
+	/* Masks of the active, toggled and oneshot layers (bit i is layers[i]). */
+	uint64_t active[MAX_LAYERS / 64];
+	uint64_t toggled[MAX_LAYERS / 64];
+	uint64_t oneshot[MAX_LAYERS / 64];
+
+	/* The layers of the keyboard's config, only rewritten when it changes. */
+	uint16_t nr_layers;
+	char layers[MAX_LAYERS][MAX_LAYER_NAME_LEN];
+};
+
+int	status_init();
+void	status_publish(const struct keyboard *kbd);
+
+const struct keyd_status	*status_map(int fd);
+void	status_read(const struct keyd_status *page, struct keyd_status *status);
+
+#endif
@@ -7,14 +7,23 @@
 #define VIRTUAL_KEYBOARD_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 struct vkbd;
 
+struct key_event {
+	uint8_t code;
+	uint8_t pressed;
+};
+
 struct vkbd	*vkbd_init(const char *name);
 void		 vkbd_move_mouse(const struct vkbd *vkbd, int x, int y);
 void		 vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state);
 void		 vkbd_send_button(const struct vkbd *vkbd, uint8_t btn, int state);
 
+/* Emit a series of key events, each in its own report. */
+void		 vkbd_send_keys(const struct vkbd *vkbd, const struct key_event *events, size_t n);
+
 void		 free_vkbd(struct vkbd *vkbd);
 
 #endif
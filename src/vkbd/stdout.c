@@ -37,6 +37,14 @@ void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
 	printf("key: %s, state: %d\n", keycode_table[code].name, state);
 }
 
+void vkbd_send_keys(const struct vkbd *vkbd, const struct key_event *events, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		vkbd_send_key(vkbd, events[i].code, events[i].pressed);
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 }
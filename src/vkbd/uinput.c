@@ -243,6 +243,34 @@ void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
 	write(vkbd->fd, &ev, sizeof(ev));
 }
 
+void vkbd_send_keys(const struct vkbd *vkbd, const struct key_event *events, size_t n)
+{
+	struct input_event evs[128];
+	size_t i, sz = 0;
+
+	/* Batch the events to minimize the number of write() calls. */
+	for (i = 0; i < n; i++) {
+		evs[sz].type = EV_KEY;
+		evs[sz].code = events[i].code;
+		evs[sz].value = events[i].pressed;
+		evs[sz].time.tv_sec = 0;
+		evs[sz].time.tv_usec = 0;
+		sz++;
+
+		evs[sz].type = EV_SYN;
+		evs[sz].code = 0;
+		evs[sz].value = 0;
+		evs[sz].time.tv_sec = 0;
+		evs[sz].time.tv_usec = 0;
+		sz++;
+
+		if (sz == sizeof(evs)/sizeof(evs[0]) || i == n-1) {
+			write(vkbd->fd, evs, sz * sizeof(evs[0]));
+			sz = 0;
+		}
+	}
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 	if (vkbd) {
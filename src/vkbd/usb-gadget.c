@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include "../keys.h"
+#include "../vkbd.h"
 #include "usb-gadget.h"
 
 static uint8_t mods = 0;
@@ -153,6 +154,14 @@ void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
 	send_hid_report(vkbd);
 }
 
+void vkbd_send_keys(const struct vkbd *vkbd, const struct key_event *events, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		vkbd_send_key(vkbd, events[i].code, events[i].pressed);
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 	close(vkbd->fd);
@@ -0,0 +1,106 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ *
+ * Compares the time taken to load a large config from text against loading
+ * its compiled image (see config_compile()). Run with `make bench`.
+ */
+#include "../src/keyd.h"
+
+#define ITERATIONS 100
+
+struct vkbd *vkbd;
+char errstr[2048];
+int debug_level;
+
+static const char *keys = "abcdefghijklmnopqrstuvwxyz1234567890";
+
+static void generate_config(const char *path)
+{
+	size_t i, j;
+	FILE *fh = fopen(path, "w");
+
+	if (!fh) {
+		perror("fopen");
+		exit(-1);
+	}
+
+	fprintf(fh, "[ids]\n*\n\n[main]\n");
+	for (i = 0; i < 20; i++)
+		fprintf(fh, "%c = overload(layer%zu, %c)\n", keys[i], i, keys[i]);
+
+	for (i = 0; i < 20; i++) {
+		fprintf(fh, "\n[layer%zu]\n", i);
+
+		for (j = 0; j < strlen(keys); j++) {
+			if (j % 4 == 0)
+				fprintf(fh, "%c = macro(hello space world %zu)\n", keys[j], i);
+			else if (j == 1)
+				fprintf(fh, "%c = timeout(a, 200, C-%c)\n", keys[j], keys[j]);
+			else
+				fprintf(fh, "%c = %c\n", keys[j], keys[(j + i) % strlen(keys)]);
+		}
+	}
+
+	fclose(fh);
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int main()
+{
+	int i;
+	long text, image;
+	char dir[] = "/tmp/keyd-bench.XXXXXX";
+	char path[sizeof dir + sizeof "/bench.conf"];
+	char img[sizeof path + sizeof ".bin"];
+	struct timespec start;
+	struct stat st;
+	static struct config config;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	snprintf(path, sizeof path, "%s/bench.conf", dir);
+	snprintf(img, sizeof img, "%s.bin", path);
+	generate_config(path);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ITERATIONS; i++) {
+		if (config_parse(&config, path) < 0)
+			return -1;
+		config_free(&config);
+	}
+	text = elapsed_us(&start) / ITERATIONS;
+
+	if (config_compile(path) < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ITERATIONS; i++) {
+		if (config_load_image(&config, path) < 0)
+			return -1;
+		config_free(&config);
+	}
+	image = elapsed_us(&start) / ITERATIONS;
+
+	printf("text:  %ld us\n", text);
+	stat(img, &st);
+
+	printf("image: %ld us (%zu bytes)\n", image, (size_t)st.st_size);
+
+	unlink(img);
+	unlink(path);
+	rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ *
+ * Applies a long series of distinct runtime bindings (as
+ * keyd-application-mapper does on every focus change) and checks that the
+ * config is left untouched and that the storage of overwritten bindings is
+ * reclaimed. Run with `make bench`.
+ */
+#include <sys/resource.h>
+#include "../src/keyd.h"
+
+#define ITERATIONS 2000000
+#define WARMUP 10000
+
+struct vkbd *vkbd;
+char errstr[2048];
+int debug_level;
+
+static const char *keys = "abcdefghijklmnopqrstuvwxyz";
+
+/* The memory allocated to the pools of a binding's storage. */
+static size_t storage_size(const struct layer_table *lt)
+{
+	return lt->cap[POOL_MACROS] * sizeof(struct macro) +
+		lt->cap[POOL_MACRO_EVENTS] * sizeof(struct macro_event) +
+		lt->cap[POOL_TIMEOUTS] * sizeof(struct timeout) +
+		lt->cap[POOL_BYTECODE];
+}
+
+/* The memory held by the runtime bindings of the keyboard (live or retired). */
+static size_t footprint(const struct keyboard *kbd)
+{
+	size_t i, j;
+	size_t sz = 0;
+	const struct overlay_storage *storage;
+
+	for (i = 0; i < kbd->overlay.nr; i++) {
+		storage = kbd->overlay.entries[i].storage;
+
+		for (j = 0; j < i; j++)
+			if (kbd->overlay.entries[j].storage == storage)
+				break;
+
+		if (j == i)
+			sz += sizeof *storage + storage_size(&storage->lt);
+	}
+
+	for (storage = kbd->overlay.retired; storage; storage = storage->next)
+		sz += sizeof *storage + storage_size(&storage->lt);
+
+	return sz;
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int main()
+{
+	size_t i;
+	size_t warm = 0;
+	long us;
+	char exp[256];
+	char path[] = "/tmp/keyd-soak.XXXXXX";
+	static struct keyboard kbd;
+	struct timespec start;
+	struct rusage ru;
+	struct layer_table base;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+
+	dprintf(fd, "[ids]\n*\n\n[main]\ncapslock = overload(control, esc)\n");
+	close(fd);
+
+	kbd.config = config_get(path);
+	unlink(path);
+
+	if (!kbd.config)
+		return -1;
+
+	kbd_init(&kbd);
+	base = kbd.config->layer_table;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ITERATIONS; i++) {
+		char key = keys[i % strlen(keys)];
+
+		switch (i % 3) {
+		case 0:
+			/* Fixed width, so each binding needs the same storage. */
+			snprintf(exp, sizeof exp, "main.%c = macro(hello %07zu)", key, i);
+			break;
+		case 1:
+			snprintf(exp, sizeof exp, "main.%c = timeout(a, %zu, C-%c)", key, i % 1000, key);
+			break;
+		case 2:
+			snprintf(exp, sizeof exp, "control.%c = overload(shift, %zu)", key, i % 10);
+			break;
+		}
+
+		if (kbd_execute_expression(&kbd, exp) < 0) {
+			fprintf(stderr, "ERROR: binding %zu (%s) failed: %s\n", i, exp, errstr);
+			return -1;
+		}
+
+		if (i == WARMUP)
+			warm = footprint(&kbd);
+	}
+	us = elapsed_us(&start);
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("bindings: %d (%ld ns each)\n", ITERATIONS, us * 1000 / ITERATIONS);
+	printf("footprint: %zu bytes after %d bindings, %zu bytes after %d (max rss: %ld KB)\n",
+	       warm, WARMUP, footprint(&kbd), ITERATIONS, ru.ru_maxrss);
+
+	if (memcmp(&kbd.config->layer_table, &base, sizeof base)) {
+		fprintf(stderr, "ERROR: the config was modified by runtime bindings\n");
+		return -1;
+	}
+
+	if (kbd.overlay.retired) {
+		fprintf(stderr, "ERROR: overwritten bindings were not reclaimed\n");
+		return -1;
+	}
+
+	if (footprint(&kbd) != warm) {
+		fprintf(stderr, "ERROR: runtime binding storage grew\n");
+		return -1;
+	}
+
+	kbd_free(&kbd);
+	return 0;
+}
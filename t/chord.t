@@ -0,0 +1,7 @@
+y down
+u down
+u up
+y up
+
+esc down
+esc up
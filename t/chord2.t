@@ -0,0 +1,9 @@
+y down
+x down
+x up
+y up
+
+y down
+x down
+x up
+y up
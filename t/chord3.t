@@ -0,0 +1,6 @@
+y down
+100ms
+y up
+
+y down
+y up
@@ -0,0 +1,15 @@
+1 down
+rightshift down
+j down
+j up
+rightshift up
+leftshift down
+j down
+j up
+leftshift up
+1 up
+
+k down
+k up
+k down
+k up
@@ -0,0 +1,527 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ *
+ * Drives the keyboard directly with a simulated clock, covering behaviour
+ * which can't be expressed as a *.t key sequence (state snapshots, config
+ * reloads, LEDs). The virtual keyboard and LEDs are stubbed out and their
+ * output is recorded. Run with `make test`.
+ */
+#include <limits.h>
+#include <stdarg.h>
+#include "../src/keyd.h"
+
+struct vkbd *vkbd;
+char errstr[2048];
+int debug_level;
+
+static char dir[] = "/tmp/keyd-test.XXXXXX";
+static struct kbd_clock sim_clock;
+static long deadline;
+
+static char output[4096];
+static size_t output_len;
+static uint8_t output_state[256];
+
+static const char *test_name;
+static int failures;
+
+static void record(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	output_len += vsnprintf(output + output_len, sizeof output - output_len, fmt, ap);
+	va_end(ap);
+
+	if (output_len >= sizeof output)
+		output_len = sizeof output - 1;
+}
+
+struct vkbd *vkbd_init(const char *name)
+{
+	return NULL;
+}
+
+void vkbd_move_mouse(const struct vkbd *vkbd, int x, int y)
+{
+}
+
+/* Like the kernel, drop events which don't change the state of a key. */
+void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
+{
+	if (output_state[code] == !!state)
+		return;
+
+	output_state[code] = !!state;
+	record("%s %s\n", keycode_table[code].name, state ? "down" : "up");
+}
+
+void vkbd_send_button(const struct vkbd *vkbd, uint8_t btn, int state)
+{
+	record("button%d %s\n", btn, state ? "down" : "up");
+}
+
+void vkbd_send_keys(const struct vkbd *vkbd, const struct key_event *events, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		vkbd_send_key(vkbd, events[i].code, events[i].pressed);
+}
+
+void free_vkbd(struct vkbd *vkbd)
+{
+}
+
+void device_set_led(const struct device *dev, int led, int state)
+{
+	record("led%d %s\n", led, state ? "on" : "off");
+}
+
+/* Write the given contents to a config in the scratch directory. */
+static const char *write_config(const char *name, const char *contents)
+{
+	static char path[PATH_MAX];
+	FILE *fh;
+
+	snprintf(path, sizeof path, "%s/%s.conf", dir, name);
+
+	if (!(fh = fopen(path, "w"))) {
+		perror("fopen");
+		exit(1);
+	}
+
+	fputs(contents, fh);
+	fclose(fh);
+
+	return path;
+}
+
+static struct config *load(const char *name, const char *contents)
+{
+	const char *path = write_config(name, contents);
+	struct config *config;
+
+	if (!(config = config_get(path))) {
+		fprintf(stderr, "ERROR: %s: %s\n", path, errstr);
+		exit(1);
+	}
+
+	return config;
+}
+
+static void setup(struct keyboard *kbd, struct config *config)
+{
+	memset(kbd, 0, sizeof *kbd);
+	memset(output_state, 0, sizeof output_state);
+
+	deadline = 0;
+	output_len = 0;
+	output[0] = 0;
+
+	kbd->config = config;
+	kbd->clock = &sim_clock;
+	kbd_init(kbd);
+}
+
+/* Feed a series of "<key> down|up" lines to the keyboard. */
+static void keys(struct keyboard *kbd, const char *script)
+{
+	char name[64];
+	char action[8];
+	int n;
+
+	while (sscanf(script, "%63s %7s\n%n", name, action, &n) == 2) {
+		struct kbd_event ev;
+
+		if (lookup_keycode(name, &ev.code, NULL) < 0) {
+			fprintf(stderr, "ERROR: %s: unknown key %s\n", test_name, name);
+			exit(1);
+		}
+
+		ev.pressed = !strcmp(action, "down");
+		ev.timestamp = sim_clock.time;
+
+		deadline = kbd_process_events(kbd, &ev, 1);
+		script += n;
+	}
+}
+
+/* Advance the clock by the given number of milliseconds, firing timers. */
+static void wait_ms(struct keyboard *kbd, long ms)
+{
+	long end = sim_clock.time + ms;
+
+	while (deadline && deadline <= end) {
+		struct kbd_event ev = { 0 };
+
+		sim_clock.time = deadline;
+		ev.timestamp = deadline;
+
+		deadline = kbd_process_events(kbd, &ev, 1);
+	}
+
+	sim_clock.time = end;
+}
+
+/* Check the output recorded since the last call. */
+static void expect(const char *expected)
+{
+	if (strcmp(output, expected)) {
+		fprintf(stderr, "FAIL %s\nexpected:\n%sgot:\n%s", test_name, expected, output);
+		failures++;
+	}
+
+	output_len = 0;
+	output[0] = 0;
+}
+
+static const char *nav_conf =
+	"[ids]\n"
+	"*\n"
+	"[main]\n"
+	"a = toggle(nav)\n"
+	"b = layer(nav)\n"
+	"[nav]\n"
+	"x = y\n";
+
+/* A saved snapshot brings back both the layer state and the output keys. */
+static void test_save_restore()
+{
+	struct keyboard kbd;
+	struct kbd_state state;
+
+	setup(&kbd, load("save-restore", nav_conf));
+
+	keys(&kbd, "leftshift down\n");
+	expect("leftshift down\n");
+
+	kbd_save_state(&kbd, &state);
+
+	keys(&kbd, "a down\na up\nleftshift up\nx down\nx up\n");
+	expect("leftshift up\ny down\ny up\n");
+
+	kbd_restore_state(&kbd, &state);
+	expect("leftshift down\n");
+
+	keys(&kbd, "x down\nx up\n");
+	expect("x down\nx up\n");
+
+	kbd_free(&kbd);
+}
+
+/* A reset drops runtime bindings but leaves toggled layers alone. */
+static void test_reset()
+{
+	struct keyboard kbd;
+
+	setup(&kbd, load("reset", nav_conf));
+
+	keys(&kbd, "a down\na up\n");
+
+	if (kbd_execute_expression(&kbd, "nav.x = z") < 0) {
+		fprintf(stderr, "ERROR: %s\n", errstr);
+		exit(1);
+	}
+
+	keys(&kbd, "x down\nx up\n");
+	expect("z down\nz up\n");
+
+	kbd_reset(&kbd);
+
+	keys(&kbd, "x down\nx up\n");
+	expect("y down\ny up\n");
+
+	kbd_free(&kbd);
+}
+
+static const char *indicator_conf =
+	"[ids]\n"
+	"*\n"
+	"[global]\n"
+	"capslock_indicator = nav\n"
+	"[main]\n"
+	"a = toggle(nav)\n"
+	"[nav]\n"
+	"x = y\n";
+
+/* The indicator LEDs are written in full after attaching or reloading. */
+static void test_leds()
+{
+	struct keyboard kbd;
+
+	setup(&kbd, load("leds", indicator_conf));
+	expect("led1 off\n");
+
+	keys(&kbd, "a down\na up\n");
+	expect("led1 on\n");
+
+	kbd_reload(&kbd, load("leds-reload", indicator_conf));
+	expect("led1 on\n");
+
+	keys(&kbd, "a down\na up\n");
+	expect("led1 off\n");
+
+	kbd_free(&kbd);
+}
+
+/*
+ * Keys struck while a macro is suspended are queued until it completes.
+ * Those which don't fit are dropped instead of cutting the macro short.
+ */
+static void test_queue_overflow()
+{
+	struct keyboard kbd;
+	size_t i;
+	char expected[2048] = "y down\ny up\n";
+
+	setup(&kbd, load("queue-overflow",
+			 "[ids]\n"
+			 "*\n"
+			 "[main]\n"
+			 "m = macro(x 500ms y)\n"));
+
+	keys(&kbd, "m down\nm up\n");
+
+	for (i = 0; i < MAX_QUEUED_EVENTS; i++)
+		keys(&kbd, "a down\na up\n");
+
+	expect("x down\nx up\n");
+
+	/* The release of m occupies one slot and each tap two. */
+	for (i = 0; i < (MAX_QUEUED_EVENTS - 1) / 2; i++)
+		strcat(expected, "a down\na up\n");
+
+	wait_ms(&kbd, 500);
+	expect(expected);
+
+	kbd_free(&kbd);
+}
+
+/* Toggled layers remain toggled across a reload, even if their index changes. */
+static void test_reload_toggled()
+{
+	struct keyboard kbd;
+
+	setup(&kbd, load("reload-toggled", nav_conf));
+
+	keys(&kbd, "a down\na up\nx down\nx up\n");
+	expect("y down\ny up\n");
+
+	kbd_reload(&kbd, load("reload-toggled2",
+			      "[ids]\n"
+			      "*\n"
+			      "[main]\n"
+			      "a = toggle(nav)\n"
+			      "[other]\n"
+			      "[nav]\n"
+			      "x = z\n"));
+
+	keys(&kbd, "x down\nx up\n");
+	expect("z down\nz up\n");
+
+	keys(&kbd, "a down\na up\nx down\nx up\n");
+	expect("x down\nx up\n");
+
+	kbd_free(&kbd);
+}
+
+/* A reload is deferred until no keys are held. */
+static void test_reload_held()
+{
+	struct keyboard kbd;
+
+	setup(&kbd, load("reload-held", nav_conf));
+
+	keys(&kbd, "b down\n");
+
+	kbd_reload(&kbd, load("reload-held2",
+			      "[ids]\n"
+			      "*\n"
+			      "[main]\n"
+			      "b = layer(nav)\n"
+			      "q = w\n"
+			      "[nav]\n"
+			      "x = z\n"));
+
+	keys(&kbd, "x down\nx up\nq down\nq up\n");
+	expect("y down\ny up\nq down\nq up\n");
+
+	keys(&kbd, "b up\nq down\nq up\nb down\nx down\nx up\nb up\n");
+	expect("w down\nw up\nz down\nz up\n");
+
+	kbd_free(&kbd);
+}
+
+/*
+ * Layers with few bindings are stored sparsely and fall through to the
+ * layers beneath them for everything else, just like dense ones.
+ */
+static void test_sparse_keymaps()
+{
+	struct keyboard kbd;
+	struct layer_table *lt;
+	char conf[4096] = "[ids]\n*\n[main]\na = layer(sparse)\nb = layer(dense)\n[sparse]\nx = y\n[dense]\n";
+	size_t i;
+
+	/* Bind enough keys to the dense layer to exceed the threshold. */
+	for (i = 0; i < SPARSE_KEYMAP_THRESHOLD; i++) {
+		const char *name = keycode_table[KEYD_F1 + i].name;
+
+		if (name && strcmp(name, "x"))
+			sprintf(conf + strlen(conf), "%s = y\n", name);
+	}
+	strcat(conf, "x = z\n");
+
+	setup(&kbd, load("sparse", conf));
+
+	lt = &kbd.config->layer_table;
+
+	if (!lt->layers[layer_table_lookup(lt, "sparse")].sparse ||
+	    lt->layers[layer_table_lookup(lt, "dense")].sparse) {
+		fprintf(stderr, "FAIL %s: unexpected keymap representation\n", test_name);
+		failures++;
+	}
+
+	keys(&kbd, "a down\nx down\nx up\nq down\nq up\na up\n");
+	expect("y down\ny up\nq down\nq up\n");
+
+	keys(&kbd, "b down\nx down\nx up\nq down\nq up\nb up\n");
+	expect("z down\nz up\nq down\nq up\n");
+
+	kbd_free(&kbd);
+}
+
+/*
+ * Identical macros share a single entry (and layers are found by name) no
+ * matter how many are defined.
+ */
+static void test_interning()
+{
+	struct keyboard kbd;
+	struct layer_table *lt;
+	char conf[16384] = "[ids]\n*\n[main]\na = macro(h i)\nb = macro(h i)\nc = toggle(layer99)\n";
+	size_t i;
+
+	for (i = 0; i < 100; i++)
+		sprintf(conf + strlen(conf), "[layer%zu]\nx = macro(h i)\n", i);
+
+	setup(&kbd, load("interning", conf));
+
+	lt = &kbd.config->layer_table;
+
+	if (lt->nr_macros != 1 || lt->nr_macro_defs != 102) {
+		fprintf(stderr, "FAIL %s: %zu macros for %zu definitions\n",
+			test_name, lt->nr_macros, lt->nr_macro_defs);
+		failures++;
+	}
+
+	for (i = 0; i < 100; i++) {
+		char name[16];
+
+		snprintf(name, sizeof name, "layer%zu", i);
+
+		if (layer_table_lookup(lt, name) == -1) {
+			fprintf(stderr, "FAIL %s: %s not found\n", test_name, name);
+			failures++;
+		}
+	}
+
+	keys(&kbd, "a down\na up\nb down\nb up\nc down\nc up\nx down\nx up\n");
+	expect("h down\nh up\ni down\ni up\n"
+	       "h down\nh up\ni down\ni up\n"
+	       "h down\nh up\ni down\ni up\n");
+
+	kbd_free(&kbd);
+}
+
+/* A config loaded from its compiled image behaves like the source. */
+static void test_image()
+{
+	struct keyboard kbd;
+	struct config *config;
+	const char *path = write_config("image",
+					"[ids]\n"
+					"*\n"
+					"[main]\n"
+					"a = toggle(nav)\n"
+					"m = macro(h i)\n"
+					"j+k = esc\n"
+					"z = leader()\n"
+					"[nav]\n"
+					"x = y\n"
+					"[leader]\n"
+					"q = w\n");
+
+	if (config_compile(path) < 0 || !(config = config_get(path))) {
+		fprintf(stderr, "ERROR: %s: %s\n", path, errstr);
+		exit(1);
+	}
+
+	if (!config->image) {
+		fprintf(stderr, "FAIL %s: the image was not used\n", test_name);
+		failures++;
+	}
+
+	setup(&kbd, config);
+
+	keys(&kbd, "m down\nm up\nj down\nk down\nk up\nj up\nz down\nz up\nq down\nq up\n");
+	expect("h down\nh up\ni down\ni up\nesc down\nesc up\nw down\nw up\n");
+
+	keys(&kbd, "a down\na up\nx down\nx up\n");
+	expect("y down\ny up\n");
+
+	kbd_free(&kbd);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)();
+} tests[] = {
+	{ "save-restore", test_save_restore },
+	{ "reset", test_reset },
+	{ "leds", test_leds },
+	{ "queue-overflow", test_queue_overflow },
+	{ "reload-toggled", test_reload_toggled },
+	{ "reload-held", test_reload_held },
+	{ "sparse-keymaps", test_sparse_keymaps },
+	{ "interning", test_interning },
+	{ "image", test_image },
+};
+
+int main()
+{
+	size_t i;
+	char path[PATH_MAX];
+	DIR *dh;
+	struct dirent *ent;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof tests / sizeof tests[0]; i++) {
+		int n = failures;
+
+		test_name = tests[i].name;
+		tests[i].fn();
+
+		printf("%s: %s\n", test_name, failures == n ? "PASS" : "FAIL");
+	}
+
+	dh = opendir(dir);
+	while ((ent = readdir(dh))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof path, "%s/%s", dir, ent->d_name);
+		unlink(path);
+	}
+	closedir(dh);
+	rmdir(dir);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+z down
+z up
+k down
+k up
+
+esc down
+esc up
@@ -0,0 +1,11 @@
+z down
+z up
+a down
+a up
+b down
+b up
+
+h down
+h up
+i down
+i up
@@ -0,0 +1,11 @@
+z down
+z up
+a down
+a up
+x down
+x up
+
+a down
+a up
+x down
+x up
@@ -0,0 +1,12 @@
+z down
+z up
+a down
+a up
+1100ms
+x down
+x up
+
+a down
+a up
+x down
+x up
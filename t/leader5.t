@@ -0,0 +1,17 @@
+z down
+z up
+rightshift down
+rightshift up
+k down
+k up
+z down
+z up
+leftshift down
+leftshift up
+k down
+k up
+
+x down
+x up
+x down
+x up
@@ -0,0 +1,14 @@
+l down
+d down
+d up
+x down
+x up
+150ms
+l up
+
+a down
+a up
+b down
+b up
+x down
+x up
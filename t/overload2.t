@@ -4,6 +4,8 @@ a down
 a up
 
 control down
-a down
 control up
+esc down
+esc up
+a down
 a up
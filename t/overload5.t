@@ -0,0 +1,10 @@
+6 down
+a down
+250ms
+6 up
+a up
+
+control down
+a down
+control up
+a up
@@ -0,0 +1,23 @@
+= down
+] down
+301ms
+] up
+= up
+= down
+] down
+201ms
+x down
+x up
+] up
+= up
+
+d down
+b down
+d up
+b up
+d down
+a down
+x down
+x up
+d up
+a up